@@ -0,0 +1,276 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 - 2021 Andriy B. Kmit'
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// Author: Andriy B. Kmit' <dev@madand.net>
+// URL: https://github.com/madand/interception-home-row-fu
+
+/* Measure how the loading of TOML configs scales with their size.
+ *
+ * Usage: bench/config-load [-n MAPPINGS] [-r ROUNDS]
+ *
+ * Configs with 8 to 100000 [[mapping]] entries (or just MAPPINGS) are generated
+ * in three shapes: plain mappings, mappings with deeply nested tables the
+ * loader skips, and mappings with long strings and escaped key names. Each is
+ * compiled ROUNDS times, and the best time of every phase is reported: the
+ * parse, the resolution of key names and the setup of the mapping table and
+ * image. Each config is measured in a child process of its own, so its peak
+ * RSS can be reported along with the calls into the allocator per compile.
+ *
+ * An image holds at most one mapping per key code, so beyond the number of
+ * key codes with a name the setup is skipped; the mappings are still parsed
+ * and resolved. */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <linux/input.h>
+
+#include "../config-toml.h"
+
+#define DEFAULT_ROUNDS 5
+/* Length of the long strings, before escapes. */
+#define LONG_STRING_SIZE 512
+
+enum shape { SHAPE_PLAIN, SHAPE_NESTED, SHAPE_LONG_STRINGS };
+
+static const char *shape_names[] = {"plain", "nested", "long strings"};
+
+static const int default_sizes[] = {8, 64, 512, 4096, 32768, 100000};
+
+struct key_name {
+    char name[32];
+    uint16_t code;
+};
+
+static const struct key_name key_names[] = {
+#include "../key-names.h"
+};
+
+/* Names of distinct key codes, for the physical keys. */
+static const char *physical_keys[KEY_CNT];
+static int physical_keys_size;
+
+/* Calls into the allocator, counted by wrapping it at link time. */
+static long allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+struct buffer {
+    char *data;
+    size_t size, capacity;
+};
+
+static void __attribute__((format(printf, 2, 3)))
+append(struct buffer *buf, const char *format, ...) {
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(buf->data + buf->size, buf->capacity - buf->size,
+                          format, args);
+        va_end(args);
+
+        if (n >= 0 && (size_t)n < buf->capacity - buf->size) {
+            buf->size += n;
+            return;
+        }
+        buf->capacity = buf->capacity ? 2 * buf->capacity : 4096;
+        buf->data     = realloc(buf->data, buf->capacity);
+        if (buf->data == NULL) {
+            fprintf(stderr, "Failed to allocate memory!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void pick_physical_keys(void) {
+    bool seen[KEY_CNT] = {false};
+    for (size_t i = 0; i < sizeof(key_names) / sizeof(*key_names); i++) {
+        uint16_t code = key_names[i].code;
+        if (code == KEY_RESERVED || code >= KEY_CNT || seen[code])
+            continue;
+        seen[code]                          = true;
+        physical_keys[physical_keys_size++] = key_names[i].name;
+    }
+}
+
+static void generate(struct buffer *buf, enum shape shape, int mappings) {
+    char long_string[LONG_STRING_SIZE + 1];
+    for (int i = 0; i < LONG_STRING_SIZE; i++)
+        long_string[i] = 'a' + i % 26;
+    long_string[LONG_STRING_SIZE] = '\0';
+
+    buf->size = 0;
+    append(buf, "burst_typing_msec = 200\ncan_insert_letter_msec = 150\n");
+    for (int i = 0; i < mappings; i++) {
+        append(buf, "\n[[mapping]]\nphysical_key = \"%s\"\n",
+               physical_keys[i % physical_keys_size]);
+
+        switch (shape) {
+        case SHAPE_PLAIN:
+            append(buf, "modifier_key = \"KEY_LEFTSHIFT\"\n");
+            break;
+        case SHAPE_NESTED:
+            append(buf,
+                   "modifier_key = \"KEY_LEFTSHIFT\"\n"
+                   "options = { timing = { burst = { msec = %d } } }\n"
+                   "[mapping.profile.device.layer.a.b.c.d]\n"
+                   "note = %d\n",
+                   i, i);
+            break;
+        case SHAPE_LONG_STRINGS:
+            // Every other name has an escape, so it takes the slow path.
+            append(buf,
+                   "modifier_key = \"%s\"\n"
+                   "description = \"%s \\t\\u00E9\\\"%s\\\"\"\n"
+                   "notes = '''\n%s\n%s'''\n",
+                   i % 2 ? "KEY_LEFT\\u0053HIFT" : "KEY_LEFTSHIFT",
+                   long_string, long_string, long_string, long_string);
+            break;
+        }
+    }
+}
+
+static uint64_t min(uint64_t a, uint64_t b) { return a < b ? a : b; }
+
+/* Compile the config of the given shape and size ROUNDS times and report. */
+static int measure(enum shape shape, int mappings, int rounds) {
+    struct buffer config          = {NULL, 0, 0};
+    struct config_toml_stats best = {UINT64_MAX, UINT64_MAX, UINT64_MAX};
+    bool setup                    = mappings <= physical_keys_size;
+    long round_allocations        = 0;
+
+    generate(&config, shape, mappings);
+    for (int round = 0; round < rounds; round++) {
+        struct config_toml_stats stats;
+        allocations = 0;
+
+        struct config_toml *compiled =
+            config_toml_read(config.data, "generated", &stats);
+        if (compiled == NULL)
+            return EXIT_FAILURE;
+        if (setup) {
+            size_t image_size;
+            void *image = config_toml_build(compiled, 0, &image_size, &stats);
+            if (image == NULL)
+                return EXIT_FAILURE;
+            free(image);
+        }
+        config_toml_free(compiled);
+        round_allocations = allocations;
+
+        best.parse_nsec   = min(best.parse_nsec, stats.parse_nsec);
+        best.resolve_nsec = min(best.resolve_nsec, stats.resolve_nsec);
+        if (setup)
+            best.setup_nsec = min(best.setup_nsec, stats.setup_nsec);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    char setup_ms[16] = "       -";
+    if (setup)
+        snprintf(setup_ms, sizeof(setup_ms), "%8.3f", best.setup_nsec / 1e6);
+    printf("%-12s %6d mappings, %9zu bytes: parse %8.3f ms, resolve %8.3f ms, "
+           "setup %s ms, %4ld allocations, peak RSS %7ld KiB\n",
+           shape_names[shape], mappings, config.size, best.parse_nsec / 1e6,
+           best.resolve_nsec / 1e6, setup_ms, round_allocations,
+           usage.ru_maxrss);
+    free(config.data);
+    return EXIT_SUCCESS;
+}
+
+/* Run measure() in a child, so that the peak RSS is of this config alone. */
+static bool measure_in_child(enum shape shape, int mappings, int rounds) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return false;
+    }
+    if (pid == 0) {
+        int status = measure(shape, mappings, rounds);
+        fflush(stdout);
+        _exit(status);
+    }
+
+    int status;
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+           WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    int mappings = 0, rounds = DEFAULT_ROUNDS;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            mappings = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n MAPPINGS] [-r ROUNDS]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    pick_physical_keys();
+    for (enum shape shape = SHAPE_PLAIN; shape <= SHAPE_LONG_STRINGS;
+         shape++) {
+        for (size_t i = 0;
+             i < sizeof(default_sizes) / sizeof(*default_sizes); i++) {
+            int size = mappings > 0 ? mappings : default_sizes[i];
+            if (!measure_in_child(shape, size, rounds))
+                return EXIT_FAILURE;
+            if (mappings > 0)
+                break;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,737 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 - 2021 Andriy B. Kmit'
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// Author: Andriy B. Kmit' <dev@madand.net>
+// URL: https://github.com/madand/interception-home-row-fu
+
+/* Replay a keyboard trace through home-row-fu and measure the latency.
+ *
+ * Usage: bench/replay [-T] [-A] [-S RUNS] [-n FRAMES] [-p PERCENT] [-s SEED]
+ *                     [-t TRACE] -- COMMAND [ARG]...
+ *
+ * Every input frame (MSC_SCAN, EV_KEY, SYN_REPORT) is written to the STDIN of
+ * COMMAND, then its STDOUT is read until the SYN_REPORT of that very frame
+ * comes back. The SYN_REPORT is tagged by rewriting its timestamp, which
+ * home-row-fu never uses. While a key decides between its letter and its
+ * modifier, home-row-fu holds back the frames that follow, SYN_REPORT
+ * included: those yield no latency sample, and their output is read with the
+ * next frames.
+ *
+ * With -T the whole trace is written as fast as COMMAND takes it, and only the
+ * throughput is reported.
+ *
+ * With -A the synthetic trace has rolls and chords with holds both within and
+ * past the burst typing window, and the keystrokes meant are known. The output
+ * is scored against them: the errors are the edit distance between the letters
+ * meant and typed (a letter counts as typed with a modifier if any key other
+ * than a letter is held), and the decision lag is the trace time from the Key
+ * Down of a letter to its output. This compares the hold/tap policies on the
+ * very same input.
+ *
+ * With -S COMMAND is started RUNS times instead, and the time from the fork to
+ * the first frame coming back is reported. This is the cold start latency,
+ * e.g. of a plugin instance spawned on the hotplug of a keyboard.
+ *
+ * TRACE is a raw dump of input events, e.g. recorded with intercept(1). Without
+ * it a synthetic typing trace is generated from SEED, so runs with different
+ * commands see exactly the same input. PERCENT of its frames are pointer
+ * motion (EV_REL), as sent by keyboards with a built-in pointing device. Run
+ * home-row-fu with --stats to have it report its syscalls per keystroke, e.g.:
+ *
+ *   bench/replay -- ./home-row-fu -c home-row-fu.toml --stats --io uring
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/input.h>
+
+typedef struct input_event input_event;
+
+/* The tv_sec value marking the SYN_REPORT closing each frame. Real event
+ * timestamps are way past it. */
+#define MARKER_SEC 1
+#define US_PER_SECOND 1000000
+#define RESPONSE_TIMEOUT_MSEC 2000
+/* A frame not answered this soon is taken as held back by a deciding key. */
+#define HELD_FRAME_MSEC 20
+/* Pause between the runs of the cold start measurement. */
+#define STARTUP_GAP_MSEC 100
+
+struct frame {
+    input_event *events;
+    size_t size;
+};
+
+static input_event *trace;
+static size_t trace_size = 0, trace_capacity = 0;
+
+static struct frame *frames;
+static size_t frames_size = 0;
+
+/* A keystroke of a letter, and whether a modifier was held. */
+struct keystroke {
+    uint16_t key;
+    bool is_modified;
+};
+
+/* What the accuracy trace means to type, and what came out of COMMAND. */
+static struct keystroke *meant, *typed;
+static size_t meant_size = 0, meant_capacity = 0;
+static size_t typed_size = 0, typed_capacity = 0;
+static bool is_scoring = false;
+
+/* State of the scoring: the time of the last Key Down of each key in the
+ * input, which keys are down in the output, and the lags of the letters. */
+static struct timeval input_down_time[KEY_CNT];
+static bool output_down[KEY_CNT];
+static int output_modifiers_down = 0;
+static uint64_t *lags;
+static size_t lags_size = 0;
+
+static void *xrealloc(void *ptr, size_t size) {
+    void *ret = realloc(ptr, size);
+    if (ret == NULL) {
+        fprintf(stderr, "Failed to allocate memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    return ret;
+}
+
+static void append_event(const struct timeval *time, uint16_t type,
+                         uint16_t code, int32_t value) {
+    if (trace_size == trace_capacity) {
+        trace_capacity = trace_capacity ? 2 * trace_capacity : 1024;
+        trace          = xrealloc(trace, trace_capacity * sizeof(*trace));
+    }
+    trace[trace_size++] = (input_event){
+        .time = *time, .type = type, .code = code, .value = value};
+}
+
+static void append_keystroke(struct keystroke **keystrokes, size_t *size,
+                             size_t *capacity, uint16_t key,
+                             bool is_modified) {
+    if (*size == *capacity) {
+        *capacity   = *capacity ? 2 * *capacity : 1024;
+        *keystrokes = xrealloc(*keystrokes, *capacity * sizeof(**keystrokes));
+    }
+    (*keystrokes)[(*size)++] =
+        (struct keystroke){.key = key, .is_modified = is_modified};
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Traces
+
+static const uint16_t letters[] = {
+    KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I,
+    KEY_O, KEY_P, KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H,
+    KEY_J, KEY_K, KEY_L, KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B,
+    KEY_N, KEY_M, KEY_SPACE, KEY_DOT, KEY_COMMA, KEY_SEMICOLON};
+static const uint16_t home_row[] = {KEY_A, KEY_S, KEY_D, KEY_F,
+                                    KEY_J, KEY_K, KEY_L, KEY_SEMICOLON};
+#define LETTERS_SIZE (sizeof(letters) / sizeof(*letters))
+#define HOME_ROW_SIZE (sizeof(home_row) / sizeof(*home_row))
+
+static bool is_letter(uint16_t key) {
+    for (size_t i = 0; i < LETTERS_SIZE; i++) {
+        if (letters[i] == key)
+            return true;
+    }
+    return false;
+}
+
+static uint64_t rng_state;
+
+static uint32_t rng_next(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 2685821657736338717ULL) >> 32);
+}
+
+static uint32_t rng_range(uint32_t min, uint32_t max) {
+    return min + rng_next() % (max - min + 1);
+}
+
+static void advance_time(struct timeval *time, uint32_t usec) {
+    time->tv_usec += usec;
+    time->tv_sec += time->tv_usec / US_PER_SECOND;
+    time->tv_usec %= US_PER_SECOND;
+}
+
+static void append_key_frame(struct timeval *time, uint16_t key,
+                             int32_t value) {
+    append_event(time, EV_MSC, MSC_SCAN, key);
+    append_event(time, EV_KEY, key, value);
+    append_event(time, EV_SYN, SYN_REPORT, 0);
+}
+
+/* Generate a typing session: mostly bursts of letters, sometimes a home row
+ * key held as a modifier for a chord. pointer_pct percent of the frames are
+ * pointer motion. */
+static void generate_trace(size_t frames_wanted, unsigned pointer_pct,
+                           uint64_t seed) {
+    const size_t letters_size  = LETTERS_SIZE;
+    const size_t home_row_size = HOME_ROW_SIZE;
+
+    struct timeval time = {.tv_sec = 1600000000, .tv_usec = 0};
+    rng_state           = seed * 0x9e3779b97f4a7c15ULL + 1;
+
+    while (trace_size / 3 < frames_wanted) {
+        if (rng_range(0, 99) < pointer_pct) {
+            append_event(&time, EV_REL, REL_X, (int32_t)rng_range(0, 20) - 10);
+            append_event(&time, EV_REL, REL_Y, (int32_t)rng_range(0, 20) - 10);
+            append_event(&time, EV_SYN, SYN_REPORT, 0);
+            advance_time(&time, 8000);
+            continue;
+        }
+
+        if (rng_range(0, 9) == 0) {
+            // Chord: hold a home row key past the burst window.
+            uint16_t mod = home_row[rng_range(0, home_row_size - 1)];
+            uint16_t key = letters[rng_range(0, letters_size - 1)];
+            if (key == mod)
+                continue;
+            append_key_frame(&time, mod, 1);
+            advance_time(&time, rng_range(250000, 500000));
+            append_key_frame(&time, key, 1);
+            advance_time(&time, rng_range(30000, 90000));
+            append_key_frame(&time, key, 0);
+            advance_time(&time, rng_range(30000, 150000));
+            append_key_frame(&time, mod, 0);
+        } else {
+            // A tap, possibly rolled into the next key.
+            uint16_t key = letters[rng_range(0, letters_size - 1)];
+            append_key_frame(&time, key, 1);
+            advance_time(&time, rng_range(40000, 120000));
+            append_key_frame(&time, key, 0);
+        }
+        advance_time(&time, rng_range(20000, 250000));
+    }
+}
+
+/* Generate what is meant to be typed, for scoring the hold/tap decisions:
+ * taps of letters (the home row keys among them), rolls of two letters, and
+ * chords of a home row key held as a modifier, with holds from well within to
+ * well past the burst typing window. A third of the chords are sloppy, the
+ * home row key is released before the other one. */
+static void generate_intent_trace(size_t frames_wanted, uint64_t seed) {
+    struct timeval time = {.tv_sec = 1600000000, .tv_usec = 0};
+    rng_state           = seed * 0x9e3779b97f4a7c15ULL + 1;
+
+    while (trace_size / 3 < frames_wanted) {
+        uint32_t kind = rng_range(0, 99);
+        uint16_t key  = letters[rng_range(0, LETTERS_SIZE - 1)];
+
+        if (kind < 15) {
+            uint16_t mod = home_row[rng_range(0, HOME_ROW_SIZE - 1)];
+            if (key == mod)
+                continue;
+            append_key_frame(&time, mod, 1);
+            advance_time(&time, rng_range(80000, 500000));
+            append_key_frame(&time, key, 1);
+            advance_time(&time, rng_range(30000, 90000));
+            if (kind < 5) {
+                // Sloppy: the modifier is let go first.
+                append_key_frame(&time, mod, 0);
+                advance_time(&time, rng_range(10000, 50000));
+                append_key_frame(&time, key, 0);
+            } else {
+                append_key_frame(&time, key, 0);
+                advance_time(&time, rng_range(20000, 150000));
+                append_key_frame(&time, mod, 0);
+            }
+            append_keystroke(&meant, &meant_size, &meant_capacity, key, true);
+        } else if (kind < 45) {
+            uint16_t next = letters[rng_range(0, LETTERS_SIZE - 1)];
+            if (key == next)
+                continue;
+            append_key_frame(&time, key, 1);
+            advance_time(&time, rng_range(30000, 90000));
+            append_key_frame(&time, next, 1);
+            advance_time(&time, rng_range(10000, 60000));
+            append_key_frame(&time, key, 0);
+            advance_time(&time, rng_range(30000, 90000));
+            append_key_frame(&time, next, 0);
+            append_keystroke(&meant, &meant_size, &meant_capacity, key, false);
+            append_keystroke(&meant, &meant_size, &meant_capacity, next,
+                             false);
+        } else {
+            append_key_frame(&time, key, 1);
+            advance_time(&time, rng_range(40000, 120000));
+            append_key_frame(&time, key, 0);
+            append_keystroke(&meant, &meant_size, &meant_capacity, key, false);
+        }
+        advance_time(&time, rng_range(20000, 250000));
+    }
+}
+
+static void load_trace(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open trace file: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    input_event event;
+    while (fread(&event, sizeof(event), 1, fp) == 1)
+        append_event(&event.time, event.type, event.code, event.value);
+    fclose(fp);
+
+    if (trace_size == 0 || trace[trace_size - 1].type != EV_SYN)
+        append_event(&event.time, EV_SYN, SYN_REPORT, 0);
+}
+
+/* Split the trace into frames at SYN_REPORT and tag each one. */
+static void split_frames(void) {
+    frames = xrealloc(NULL, trace_size * sizeof(*frames));
+
+    size_t start = 0;
+    for (size_t i = 0; i < trace_size; i++) {
+        if (trace[i].type != EV_SYN || trace[i].code != SYN_REPORT)
+            continue;
+
+        trace[i].time.tv_sec  = MARKER_SEC;
+        trace[i].time.tv_usec = frames_size % US_PER_SECOND;
+        frames[frames_size++] =
+            (struct frame){.events = trace + start, .size = i + 1 - start};
+        start = i + 1;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Replay
+
+static int child_in, child_out;
+static pid_t child_pid;
+
+static void spawn(char *argv[]) {
+    int in_pipe[2], out_pipe[2];
+    if (pipe(in_pipe) == -1 || pipe(out_pipe) == -1) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    child_pid = fork();
+    if (child_pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+
+    if (child_pid == 0) {
+        dup2(in_pipe[0], STDIN_FILENO);
+        dup2(out_pipe[1], STDOUT_FILENO);
+        close(in_pipe[0]);
+        close(in_pipe[1]);
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    close(in_pipe[0]);
+    close(out_pipe[1]);
+    child_in  = in_pipe[1];
+    child_out = out_pipe[0];
+}
+
+static void write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static unsigned char out_buf[64 * sizeof(input_event)];
+static size_t out_fill = 0;
+
+/* Note the Key Downs of the input frame, for the lags of the letters. */
+static void score_input_frame(const struct frame *frame) {
+    for (size_t i = 0; i < frame->size; i++) {
+        const input_event *event = &frame->events[i];
+        if (event->type == EV_KEY && event->code < KEY_CNT && event->value == 1)
+            input_down_time[event->code] = event->time;
+    }
+}
+
+/* Note a key event of the output, which came in response to the input frame
+ * seq. */
+static void score_output_event(const input_event *event, size_t seq) {
+    if (event->type != EV_KEY || event->code >= KEY_CNT ||
+        (event->value != 0 && event->value != 1))
+        return;
+
+    bool is_down = event->value == 1;
+    // A BackSpace takes the last letter back, as on the screen (speculative
+    // letters).
+    if (event->code == KEY_BACKSPACE) {
+        if (is_down && typed_size > 0) {
+            typed_size--;
+            lags_size--;
+        }
+        return;
+    }
+    if (output_down[event->code] != is_down && !is_letter(event->code))
+        output_modifiers_down += is_down ? 1 : -1;
+    output_down[event->code] = is_down;
+    if (!is_down || !is_letter(event->code))
+        return;
+
+    append_keystroke(&typed, &typed_size, &typed_capacity, event->code,
+                     output_modifiers_down > 0);
+    const struct timeval *down = &input_down_time[event->code];
+    const struct timeval *now  = &frames[seq].events[0].time;
+    lags[lags_size++] = ((now->tv_sec - down->tv_sec) * US_PER_SECOND +
+                         now->tv_usec - down->tv_usec) *
+                        1000;
+}
+
+/* Consume the buffered output up to the SYN_REPORT tagged with seq. Return
+ * true if it was found. */
+static bool consume_until_marker(size_t seq) {
+    size_t whole = out_fill / sizeof(input_event);
+    size_t used  = whole * sizeof(input_event);
+    bool found   = false;
+
+    for (size_t i = 0; i < whole; i++) {
+        input_event event;
+        memcpy(&event, out_buf + i * sizeof(event), sizeof(event));
+        if (event.type == EV_SYN && event.time.tv_sec == MARKER_SEC &&
+            (size_t)event.time.tv_usec == seq % US_PER_SECOND) {
+            used  = (i + 1) * sizeof(event);
+            found = true;
+            break;
+        }
+        if (is_scoring)
+            score_output_event(&event, seq);
+    }
+
+    memmove(out_buf, out_buf + used, out_fill - used);
+    out_fill -= used;
+    return found;
+}
+
+/* Read whatever output is available. */
+static void read_output(size_t seq) {
+    ssize_t n =
+        read(child_out, out_buf + out_fill, sizeof(out_buf) - out_fill);
+    if (n <= 0) {
+        fprintf(stderr, "Unexpected end of output at frame %zu\n", seq);
+        exit(EXIT_FAILURE);
+    }
+    out_fill += n;
+}
+
+/* Read the output until the SYN_REPORT tagged with seq shows up. Return false
+ * if the output stays silent for timeout_msec before that. */
+static bool wait_for_marker(size_t seq, int timeout_msec) {
+    while (!consume_until_marker(seq)) {
+        struct pollfd pfd = {.fd = child_out, .events = POLLIN};
+        if (poll(&pfd, 1, timeout_msec) == 0)
+            return false;
+        read_output(seq);
+    }
+    return true;
+}
+
+/* Write the whole trace without waiting for the responses, reading the output
+ * as it comes, until the last frame is through. */
+static void replay_throughput(void) {
+    const char *buf  = (const char *)trace;
+    size_t total     = trace_size * sizeof(input_event), written = 0;
+    size_t last      = frames_size - 1;
+
+    fcntl(child_in, F_SETFL, fcntl(child_in, F_GETFL) | O_NONBLOCK);
+
+    for (;;) {
+        struct pollfd pfds[2] = {
+            {.fd = child_out, .events = POLLIN},
+            {.fd = child_in, .events = written < total ? POLLOUT : 0},
+        };
+        if (poll(pfds, 2, RESPONSE_TIMEOUT_MSEC) == 0) {
+            fprintf(stderr, "No response for the last frame\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (pfds[1].revents & POLLOUT) {
+            ssize_t n = write(child_in, buf + written, total - written);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("write");
+                exit(EXIT_FAILURE);
+            }
+            if (n > 0)
+                written += n;
+        }
+
+        if (pfds[0].revents & (POLLIN | POLLHUP)) {
+            read_output(last);
+            if (consume_until_marker(last) && written == total)
+                return;
+        }
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_usec(const uint64_t *sorted, size_t size,
+                              double pct) {
+    size_t idx = (size_t)(pct / 100.0 * (size - 1) + 0.5);
+    return sorted[idx] / 1000.0;
+}
+
+static void finish_child(void) {
+    close(child_in);
+
+    // Drain whatever is left so the child never blocks on a full pipe.
+    char buf[4096];
+    while (read(child_out, buf, sizeof(buf)) > 0)
+        ;
+    close(child_out);
+
+    int status;
+    waitpid(child_pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fprintf(stderr, "Warning: command exited abnormally\n");
+}
+
+/* Start the command runs times, and measure how long it takes until the first
+ * frame comes through. */
+static void replay_startup(char *argv[], size_t runs) {
+    uint64_t *startups = xrealloc(NULL, runs * sizeof(*startups));
+
+    for (size_t i = 0; i < runs; i++) {
+        uint64_t start = now_ns();
+        spawn(argv);
+        write_all(child_in, frames[0].events,
+                  frames[0].size * sizeof(input_event));
+        if (!wait_for_marker(0, RESPONSE_TIMEOUT_MSEC)) {
+            fprintf(stderr, "No response for frame 0\n");
+            exit(EXIT_FAILURE);
+        }
+        startups[i] = now_ns() - start;
+        finish_child();
+        out_fill = 0;
+        // Hotplugs are far apart, give the command time to settle.
+        usleep(STARTUP_GAP_MSEC * 1000);
+    }
+
+    qsort(startups, runs, sizeof(*startups), compare_u64);
+    printf("Runs: %zu\n", runs);
+    printf("Cold start (usec): p50 %.1f, p90 %.1f, max %.1f\n",
+           percentile_usec(startups, runs, 50),
+           percentile_usec(startups, runs, 90), startups[runs - 1] / 1000.0);
+    free(startups);
+}
+
+static bool is_same_keystroke(const struct keystroke *a,
+                              const struct keystroke *b) {
+    return a->key == b->key && a->is_modified == b->is_modified;
+}
+
+/* Return the edit distance between the keystrokes meant and typed. */
+static size_t count_errors(void) {
+    size_t *prev = xrealloc(NULL, (typed_size + 1) * sizeof(*prev));
+    size_t *curr = xrealloc(NULL, (typed_size + 1) * sizeof(*curr));
+
+    for (size_t j = 0; j <= typed_size; j++)
+        prev[j] = j;
+    for (size_t i = 1; i <= meant_size; i++) {
+        curr[0] = i;
+        for (size_t j = 1; j <= typed_size; j++) {
+            size_t substitute =
+                prev[j - 1] + !is_same_keystroke(&meant[i - 1], &typed[j - 1]);
+            size_t delete = prev[j] + 1, insert = curr[j - 1] + 1;
+            curr[j]       = substitute < delete ? substitute : delete;
+            if (insert < curr[j])
+                curr[j] = insert;
+        }
+        size_t *swap = prev;
+        prev         = curr;
+        curr         = swap;
+    }
+
+    size_t errors = prev[typed_size];
+    free(prev);
+    free(curr);
+    return errors;
+}
+
+static void print_score(void) {
+    size_t errors = count_errors();
+    printf("Keystrokes: %zu meant, %zu typed, %zu errors (%.2f%%)\n",
+           meant_size, typed_size, errors,
+           meant_size ? 100.0 * errors / meant_size : 0.0);
+
+    if (lags_size == 0)
+        return;
+    qsort(lags, lags_size, sizeof(*lags), compare_u64);
+    printf("Letter lag (msec): p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+           percentile_usec(lags, lags_size, 50) / 1000,
+           percentile_usec(lags, lags_size, 90) / 1000,
+           percentile_usec(lags, lags_size, 99) / 1000,
+           lags[lags_size - 1] / 1e6);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [-T] [-A] [-S RUNS] [-n FRAMES] [-p PERCENT] [-s SEED] "
+            "[-t TRACE] -- COMMAND [ARG]...\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    size_t frames_wanted   = 20000;
+    unsigned pointer_pct   = 0;
+    uint64_t seed          = 1;
+    const char *trace_file = NULL;
+    bool throughput_only   = false;
+    size_t startup_runs    = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "TAS:n:p:s:t:")) != -1) {
+        switch (opt) {
+        case 'T':
+            throughput_only = true;
+            break;
+        case 'A':
+            is_scoring = true;
+            break;
+        case 'S':
+            startup_runs = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            pointer_pct = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            frames_wanted = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            trace_file = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc)
+        usage(argv[0]);
+
+    if (is_scoring && (trace_file || throughput_only || startup_runs > 0))
+        usage(argv[0]);
+
+    if (trace_file)
+        load_trace(trace_file);
+    else if (is_scoring)
+        generate_intent_trace(frames_wanted, seed);
+    else
+        generate_trace(frames_wanted, pointer_pct, seed);
+    split_frames();
+    if (is_scoring)
+        lags = xrealloc(NULL, trace_size * sizeof(*lags));
+
+    if (startup_runs > 0) {
+        replay_startup(argv + optind, startup_runs);
+        return EXIT_SUCCESS;
+    }
+
+    uint64_t *latencies = xrealloc(NULL, frames_size * sizeof(*latencies));
+
+    spawn(argv + optind);
+
+    uint64_t start = now_ns();
+    if (throughput_only) {
+        replay_throughput();
+        uint64_t elapsed = now_ns() - start;
+        finish_child();
+        printf("Frames: %zu, events: %zu, %.0f events/s\n", frames_size,
+               trace_size, trace_size / (elapsed / 1e9));
+        return EXIT_SUCCESS;
+    }
+
+    // Frames held back are answered with the later ones, so only a long run
+    // of silence means the command is stuck.
+    size_t samples = 0, silent_msec = 0;
+    for (size_t i = 0; i < frames_size; i++) {
+        if (is_scoring)
+            score_input_frame(&frames[i]);
+        uint64_t sent = now_ns();
+        write_all(child_in, frames[i].events,
+                  frames[i].size * sizeof(input_event));
+        if (wait_for_marker(i, HELD_FRAME_MSEC)) {
+            latencies[samples++] = now_ns() - sent;
+            silent_msec          = 0;
+        } else if ((silent_msec += HELD_FRAME_MSEC) >= RESPONSE_TIMEOUT_MSEC) {
+            fprintf(stderr, "No response for frame %zu\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    finish_child();
+
+    qsort(latencies, samples, sizeof(*latencies), compare_u64);
+    printf("Frames: %zu, %zu held back, %.0f frames/s\n", frames_size,
+           frames_size - samples, frames_size / (elapsed / 1e9));
+    if (samples > 0)
+        printf("Latency (usec): p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+               percentile_usec(latencies, samples, 50),
+               percentile_usec(latencies, samples, 90),
+               percentile_usec(latencies, samples, 99),
+               latencies[samples - 1] / 1000.0);
+    if (is_scoring)
+        print_score();
+
+    return EXIT_SUCCESS;
+}
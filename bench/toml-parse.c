@@ -0,0 +1,358 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 - 2021 Andriy B. Kmit'
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// Author: Andriy B. Kmit' <dev@madand.net>
+// URL: https://github.com/madand/interception-home-row-fu
+
+/* Measure how long lib/toml.c takes to parse large configs, to look up all of
+ * their keys and to free them.
+ *
+ * Usage: bench/toml-parse [-n ENTRIES] [-r ROUNDS]
+ *
+ * Three shapes of config are generated with ENTRIES entries each (10000 by
+ * default): a [[mapping]] array of tables, one table with that many keys, and
+ * that many [tables] at the top level. Each is parsed ROUNDS times from memory
+ * with toml_parse() and toml_parse_arena(), and from a temporary file with
+ * toml_parse_file() and toml_parse_mmap(), and with toml_parse_stream(),
+ * which builds no tables. The best times are reported along with the number
+ * of calls into the allocator per parse and the peak size of the heap used by
+ * the parser. */
+
+#include <malloc.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lib/toml.h"
+
+#define ERROR_BUFFER_SIZE 200
+
+enum shape { SHAPE_MAPPINGS, SHAPE_KEYS, SHAPE_TABLES };
+
+static const char *shape_names[] = {"[[mapping]] array", "keys in a table",
+                                    "top-level tables"};
+
+enum parser {
+    PARSER_MALLOC,
+    PARSER_ARENA,
+    PARSER_FILE,
+    PARSER_MMAP,
+    PARSER_STREAM,
+    PARSERS
+};
+
+static const char *parser_names[] = {"malloc", "arena", "file", "mmap",
+                                     "stream"};
+
+struct buffer {
+    char *data;
+    size_t size, capacity;
+};
+
+static void __attribute__((format(printf, 2, 3)))
+append(struct buffer *buf, const char *format, ...) {
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(buf->data + buf->size, buf->capacity - buf->size,
+                          format, args);
+        va_end(args);
+
+        if (n >= 0 && (size_t)n < buf->capacity - buf->size) {
+            buf->size += n;
+            return;
+        }
+        buf->capacity = buf->capacity ? 2 * buf->capacity : 4096;
+        buf->data     = realloc(buf->data, buf->capacity);
+        if (buf->data == NULL) {
+            fprintf(stderr, "Failed to allocate memory!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void generate(struct buffer *buf, enum shape shape, int entries) {
+    buf->size = 0;
+    append(buf, "burst_typing_msec = 200\n");
+    if (shape == SHAPE_KEYS)
+        append(buf, "[keys]\n");
+
+    for (int i = 0; i < entries; i++) {
+        switch (shape) {
+        case SHAPE_MAPPINGS:
+            append(buf,
+                   "[[mapping]]\nphysical_key = %d\nmodifier_key = "
+                   "\"KEY_LEFTSHIFT\"\n",
+                   i);
+            break;
+        case SHAPE_KEYS:
+            append(buf, "key_%d = %d\n", i, i);
+            break;
+        case SHAPE_TABLES:
+            append(buf, "[table_%d]\nvalue = %d\n", i, i);
+            break;
+        }
+    }
+}
+
+/* Calls into the allocator and bytes allocated, tracked through
+ * toml_set_memutil(). The bytes are what malloc() really set aside, so small
+ * blocks are not undercounted against the arena. */
+#define BLOCK_HEADER_SIZE 16
+
+static long allocations;
+static size_t heap_size, heap_peak;
+
+static void *track(char *block) {
+    if (block == NULL)
+        return NULL;
+    size_t size      = malloc_usable_size(block);
+    *(size_t *)block = size;
+    heap_size += size;
+    if (heap_size > heap_peak)
+        heap_peak = heap_size;
+    return block + BLOCK_HEADER_SIZE;
+}
+
+static void *counting_malloc(size_t size) {
+    allocations++;
+    return track(malloc(BLOCK_HEADER_SIZE + size));
+}
+
+static void counting_free(void *ptr) {
+    if (ptr == NULL)
+        return;
+    char *block = (char *)ptr - BLOCK_HEADER_SIZE;
+    heap_size -= *(size_t *)block;
+    free(block);
+}
+
+static void *counting_calloc(size_t count, size_t size) {
+    allocations++;
+    return track(calloc(1, BLOCK_HEADER_SIZE + count * size));
+}
+
+static void *counting_realloc(void *ptr, size_t size) {
+    if (ptr == NULL)
+        return counting_malloc(size);
+    allocations++;
+    char *block     = (char *)ptr - BLOCK_HEADER_SIZE;
+    size_t old_size = *(size_t *)block;
+    block           = realloc(block, BLOCK_HEADER_SIZE + size);
+    if (block == NULL)
+        return NULL;
+    heap_size -= old_size;
+    return track(block);
+}
+
+/* Write the config to a temporary file. Return it open for reading. */
+static FILE *write_temporary(const struct buffer *buf) {
+    FILE *fp = tmpfile();
+    if (fp == NULL || fwrite(buf->data, 1, buf->size, fp) != buf->size ||
+        fflush(fp) != 0) {
+        perror("Failed to write a temporary file");
+        exit(EXIT_FAILURE);
+    }
+    return fp;
+}
+
+static toml_table_t *parse(enum parser parser, char *data, FILE *fp,
+                           char *err_buf, int err_buf_size) {
+    switch (parser) {
+    case PARSER_MALLOC:
+        return toml_parse(data, err_buf, err_buf_size);
+    case PARSER_ARENA:
+        return toml_parse_arena(data, err_buf, err_buf_size);
+    case PARSER_FILE:
+        rewind(fp);
+        return toml_parse_file(fp, err_buf, err_buf_size);
+    case PARSER_MMAP:
+        return toml_parse_mmap(fileno(fp), err_buf, err_buf_size);
+    default:
+        return NULL;
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Entries seen by the streaming parser. */
+struct stream_count {
+    enum shape shape;
+    int found;
+};
+
+static int count_table(void *arg, const char *const *path, int depth,
+                       int array) {
+    struct stream_count *count = arg;
+    if (count->shape == SHAPE_TABLES && !array && depth == 1 &&
+        strncmp(path[0], "table_", 6) == 0)
+        count->found++;
+    return 0;
+}
+
+static int count_keyval(void *arg, const char *const *path, int depth,
+                        const char *key, const char *raw, int raw_len) {
+    struct stream_count *count = arg;
+    (void)raw;
+    (void)raw_len;
+    if (depth != 1)
+        return 0;
+    if (count->shape == SHAPE_MAPPINGS) {
+        count->found += strcmp(path[0], "mapping") == 0 &&
+                        strcmp(key, "modifier_key") == 0;
+    } else if (count->shape == SHAPE_KEYS) {
+        count->found += strcmp(path[0], "keys") == 0;
+    }
+    return 0;
+}
+
+/* Look up every entry of the config. Return the number found. */
+static int look_up_all(toml_table_t *root, enum shape shape, int entries) {
+    char key[32];
+    int found = 0;
+
+    if (shape == SHAPE_MAPPINGS) {
+        toml_array_t *mappings = toml_array_in(root, "mapping");
+        for (int i = 0; i < toml_array_nelem(mappings); i++) {
+            toml_table_t *mapping = toml_table_at(mappings, i);
+            if (toml_raw_in(mapping, "physical_key") &&
+                toml_raw_in(mapping, "modifier_key"))
+                found++;
+        }
+        return found;
+    }
+
+    toml_table_t *keys = toml_table_in(root, "keys");
+    for (int i = 0; i < entries; i++) {
+        if (shape == SHAPE_KEYS) {
+            snprintf(key, sizeof(key), "key_%d", i);
+            found += toml_raw_in(keys, key) != NULL;
+        } else {
+            snprintf(key, sizeof(key), "table_%d", i);
+            found += toml_table_in(root, key) != NULL;
+        }
+    }
+    return found;
+}
+
+int main(int argc, char *argv[]) {
+    int entries = 10000, rounds = 5;
+    char err_buf[ERROR_BUFFER_SIZE];
+    struct buffer config = {NULL, 0, 0};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            entries = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n ENTRIES] [-r ROUNDS]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    toml_set_memutil(counting_malloc, counting_free, counting_calloc,
+                     counting_realloc);
+
+    for (int i = 0; i < PARSERS * 3; i++) {
+        enum shape shape    = i / PARSERS;
+        enum parser parser  = i % PARSERS;
+        uint64_t best_parse = UINT64_MAX, best_lookup = UINT64_MAX,
+                 best_free = UINT64_MAX;
+        long parse_allocations = 0;
+
+        generate(&config, shape, entries);
+        FILE *fp  = write_temporary(&config);
+        heap_peak = 0;
+        for (int round = 0; round < rounds; round++) {
+            // toml_parse() takes a non-const buffer.
+            char *copy     = strdup(config.data);
+            allocations    = 0;
+            heap_size      = 0;
+            uint64_t start = now_ns();
+            toml_table_t *root = NULL;
+            int found;
+
+            if (parser == PARSER_STREAM) {
+                // Looking the entries up is part of the parse.
+                struct stream_count count = {shape, 0};
+                toml_stream_t stream = {count_table, count_keyval, &count};
+                if (toml_parse_stream(copy, &stream, err_buf,
+                                      sizeof(err_buf)) != 0) {
+                    fprintf(stderr, "Failed to parse: %s\n", err_buf);
+                    return EXIT_FAILURE;
+                }
+                found = count.found;
+            } else {
+                root = parse(parser, copy, fp, err_buf, sizeof(err_buf));
+                if (root == NULL) {
+                    fprintf(stderr, "Failed to parse: %s\n", err_buf);
+                    return EXIT_FAILURE;
+                }
+            }
+            uint64_t parsed   = now_ns();
+            parse_allocations = allocations;
+            if (root != NULL)
+                found = look_up_all(root, shape, entries);
+            uint64_t looked_up = now_ns();
+            if (found != entries) {
+                fprintf(stderr, "Found %d entries of %d\n", found, entries);
+                return EXIT_FAILURE;
+            }
+
+            if (parsed - start < best_parse)
+                best_parse = parsed - start;
+            if (looked_up - parsed < best_lookup)
+                best_lookup = looked_up - parsed;
+            toml_free(root);
+            if (now_ns() - looked_up < best_free)
+                best_free = now_ns() - looked_up;
+            free(copy);
+        }
+        fclose(fp);
+
+        printf("%-18s %-6s %6d entries, %8zu bytes: parse %9.3f ms, "
+               "lookup %8.3f ms, free %8.3f ms, %8ld allocations, "
+               "peak heap %8zu KiB\n",
+               shape_names[shape], parser_names[parser], entries,
+               config.size, best_parse / 1e6, best_lookup / 1e6,
+               best_free / 1e6, parse_allocations, heap_peak / 1024);
+    }
+
+    free(config.data);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,93 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 - 2021 Andriy B. Kmit'
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// Author: Andriy B. Kmit' <dev@madand.net>
+// URL: https://github.com/madand/interception-home-row-fu
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bigrams.h"
+
+// clang-format off
+const uint8_t bigram_keys[KEY_CNT] = {
+    [KEY_A] = 1,           [KEY_B] = 2,           [KEY_C] = 3,
+    [KEY_D] = 4,           [KEY_E] = 5,           [KEY_F] = 6,
+    [KEY_G] = 7,           [KEY_H] = 8,           [KEY_I] = 9,
+    [KEY_J] = 10,          [KEY_K] = 11,          [KEY_L] = 12,
+    [KEY_M] = 13,          [KEY_N] = 14,          [KEY_O] = 15,
+    [KEY_P] = 16,          [KEY_Q] = 17,          [KEY_R] = 18,
+    [KEY_S] = 19,          [KEY_T] = 20,          [KEY_U] = 21,
+    [KEY_V] = 22,          [KEY_W] = 23,          [KEY_X] = 24,
+    [KEY_Y] = 25,          [KEY_Z] = 26,          [KEY_1] = 27,
+    [KEY_2] = 28,          [KEY_3] = 29,          [KEY_4] = 30,
+    [KEY_5] = 31,          [KEY_6] = 32,          [KEY_7] = 33,
+    [KEY_8] = 34,          [KEY_9] = 35,          [KEY_0] = 36,
+    [KEY_GRAVE] = 37,      [KEY_MINUS] = 38,      [KEY_EQUAL] = 39,
+    [KEY_LEFTBRACE] = 40,  [KEY_RIGHTBRACE] = 41, [KEY_BACKSLASH] = 42,
+    [KEY_SEMICOLON] = 43,  [KEY_APOSTROPHE] = 44, [KEY_COMMA] = 45,
+    [KEY_DOT] = 46,        [KEY_SLASH] = 47,      [KEY_SPACE] = 48,
+};
+// clang-format on
+
+bool bigram_table_read(const char *path, struct bigram_table *table) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    size_t n = fread(table, sizeof(*table), 1, fp);
+    // Anything past the table means it is not one.
+    bool is_whole = n == 1 && fgetc(fp) == EOF;
+    fclose(fp);
+
+    if (!is_whole ||
+        memcmp(table->magic, BIGRAM_MAGIC, BIGRAM_MAGIC_SIZE) != 0 ||
+        table->version != BIGRAM_VERSION || table->keys != BIGRAM_KEYS) {
+        fprintf(stderr,
+                "Error: %s is not a bigram table of this version; learn it "
+                "again.\n",
+                path);
+        return false;
+    }
+    return true;
+}
+
+bool bigram_table_write(const char *path, struct bigram_table *table) {
+    memcpy(table->magic, BIGRAM_MAGIC, BIGRAM_MAGIC_SIZE);
+    table->version = BIGRAM_VERSION;
+    table->keys    = BIGRAM_KEYS;
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    bool ok = fwrite(table, sizeof(*table), 1, fp) == 1;
+    ok      = fclose(fp) == 0 && ok;
+    if (!ok)
+        fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+    return ok;
+}
@@ -0,0 +1,75 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 - 2021 Andriy B. Kmit'
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// Author: Andriy B. Kmit' <dev@madand.net>
+// URL: https://github.com/madand/interception-home-row-fu
+
+/* Bigram timing table: a burst typing window for every pair of keys typed one
+ * after the other, as some pairs are rolled much faster than others. Learned
+ * from recorded typing by home-row-fu-bigrams and loaded by home-row-fu
+ * --bigrams.
+ *
+ * The keys of the typing block have compact codes from 1 to BIGRAM_KEYS - 1,
+ * all the other keys share 0. The file is struct bigram_table as is. */
+
+#ifndef BIGRAMS_H
+#define BIGRAMS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/input.h>
+
+#define BIGRAM_MAGIC "HRFUBGR"
+#define BIGRAM_MAGIC_SIZE 8
+/* Bump on any change of struct bigram_table or of the compact codes. */
+#define BIGRAM_VERSION 1
+/* Letters, digits, punctuation and the space bar, plus one for the rest. */
+#define BIGRAM_KEYS 49
+
+struct bigram_table {
+    char magic[BIGRAM_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t keys;
+    /* Burst typing window of a key in milliseconds, by the compact codes of the
+     * key pressed before it and of the key itself. 0 where not learned. */
+    uint16_t window_msec[BIGRAM_KEYS][BIGRAM_KEYS];
+};
+
+/* Compact codes by key code. */
+extern const uint8_t bigram_keys[KEY_CNT];
+
+/* Return the compact code of the key. */
+static inline int bigram_key(uint16_t key_code) {
+    return key_code < KEY_CNT ? bigram_keys[key_code] : 0;
+}
+
+/* Read and check the table. Return false after printing the reason if it
+ * cannot be used. */
+bool bigram_table_read(const char *path, struct bigram_table *table);
+
+/* Write the table, setting its magic, version and size. Return false after
+ * printing the reason on failure. */
+bool bigram_table_write(const char *path, struct bigram_table *table);
+
+#endif
@@ -0,0 +1,517 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 - 2021 Andriy B. Kmit'
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// Author: Andriy B. Kmit' <dev@madand.net>
+// URL: https://github.com/madand/interception-home-row-fu
+
+#include <errno.h>
+#include <fcntl.h>     // open
+#include <inttypes.h>  // PRIx64, PRId64
+#include <limits.h>    // PATH_MAX
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config-image.h"
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+/* Permissions of the written images. */
+#define IMAGE_FILE_MODE 0644
+
+static size_t align_up(size_t size) {
+    return (size + CONFIG_IMAGE_ALIGN - 1) & ~(size_t)(CONFIG_IMAGE_ALIGN - 1);
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    return hash;
+}
+
+/* FNV-1a hash of the image, skipping over the checksum field. */
+static uint64_t image_checksum(const void *image, size_t image_size) {
+    const unsigned char *bytes = image;
+    const size_t skip_start = offsetof(struct config_image_header, checksum);
+    const size_t skip_end   = skip_start + sizeof(uint64_t);
+    const uint64_t zero     = 0;
+
+    uint64_t hash = fnv1a(FNV_OFFSET_BASIS, bytes, skip_start);
+    hash          = fnv1a(hash, &zero, sizeof(zero));
+    return fnv1a(hash, bytes + skip_end, image_size - skip_end);
+}
+
+/* Return true if the event is a Key Down or Up (value) of a key in range. */
+static bool is_key_event(const input_event *event, int32_t value) {
+    return event->type == EV_KEY && event->code < KEY_CNT &&
+           event->value == value;
+}
+
+/* Return true if the key and all the events the mapping sends are of keys in
+ * range, as the engine indexes tables by their codes. */
+static bool are_mapping_keys_valid(const key_mapping *mapping) {
+    return mapping->key < KEY_CNT &&
+           is_key_event(&mapping->ev_real_down, EVENT_VALUE_KEY_DOWN) &&
+           is_key_event(&mapping->ev_real_up, EVENT_VALUE_KEY_UP) &&
+           is_key_event(&mapping->ev_modifier_down, EVENT_VALUE_KEY_DOWN) &&
+           is_key_event(&mapping->ev_modifier_up, EVENT_VALUE_KEY_UP) &&
+           is_key_event(&mapping->ev_correction_down, EVENT_VALUE_KEY_DOWN) &&
+           is_key_event(&mapping->ev_correction_up, EVENT_VALUE_KEY_UP);
+}
+
+uint64_t config_image_source_hash(const void *source, size_t source_size) {
+    const uint32_t version = CONFIG_IMAGE_VERSION;
+    uint64_t hash          = fnv1a(FNV_OFFSET_BASIS, &version, sizeof(version));
+    return fnv1a(hash, source, source_size);
+}
+
+bool config_image_has_magic(const void *data, size_t size) {
+    return size >= CONFIG_IMAGE_MAGIC_SIZE &&
+           memcmp(data, CONFIG_IMAGE_MAGIC, CONFIG_IMAGE_MAGIC_SIZE) == 0;
+}
+
+void *config_image_build(const struct config_settings *settings,
+                         const key_mapping *mappings, int mappings_size,
+                         uint64_t source_hash, size_t *image_size) {
+    const size_t mappings_offset = align_up(sizeof(struct config_image_header));
+    const size_t key_index_offset =
+        align_up(mappings_offset + mappings_size * sizeof(key_mapping));
+    const size_t size = key_index_offset + KEY_CNT * sizeof(uint16_t);
+
+    if (mappings_size > UINT16_MAX - 1) {
+        fprintf(stderr, "Error: too many mappings (%d).\n", mappings_size);
+        return NULL;
+    }
+
+    // Zeroed, so the padding bytes are deterministic and the checksum of the
+    // same configuration is always the same.
+    unsigned char *image = calloc(1, size);
+    if (image == NULL) {
+        fprintf(stderr, "Failed to allocate memory!\n");
+        return NULL;
+    }
+
+    struct config_image_header *header = (struct config_image_header *)image;
+    key_mapping *image_mappings = (key_mapping *)(image + mappings_offset);
+    uint16_t *key_index         = (uint16_t *)(image + key_index_offset);
+
+    for (int i = 0; i < mappings_size; i++) {
+        const key_mapping *mapping = &mappings[i];
+        if (!are_mapping_keys_valid(mapping)) {
+            fprintf(stderr, "Error: key code out of range in mapping %d.\n",
+                    i + 1);
+            free(image);
+            return NULL;
+        }
+        if (key_index[mapping->key] != 0) {
+            fprintf(stderr, "Error: key %u is mapped more than once.\n",
+                    mapping->key);
+            free(image);
+            return NULL;
+        }
+
+        key_mapping *dest               = &image_mappings[i];
+        dest->key                       = mapping->key;
+        dest->immediately_send_modifier = mapping->immediately_send_modifier;
+        dest->hand                      = mapping->hand;
+        dest->hold_tap_policy           = mapping->hold_tap_policy;
+        dest->bilateral_combinations    = mapping->bilateral_combinations;
+        dest->speculative_letters       = mapping->speculative_letters;
+        dest->burst_typing_usec         = mapping->burst_typing_usec;
+        dest->can_insert_letter_usec    = mapping->can_insert_letter_usec;
+        dest->ev_real_down              = mapping->ev_real_down;
+        dest->ev_real_up                = mapping->ev_real_up;
+        dest->ev_modifier_down          = mapping->ev_modifier_down;
+        dest->ev_modifier_up            = mapping->ev_modifier_up;
+        dest->ev_correction_down        = mapping->ev_correction_down;
+        dest->ev_correction_up          = mapping->ev_correction_up;
+        key_index[mapping->key]         = (uint16_t)(i + 1);
+    }
+
+    memcpy(header->magic, CONFIG_IMAGE_MAGIC, CONFIG_IMAGE_MAGIC_SIZE);
+    header->version          = CONFIG_IMAGE_VERSION;
+    header->header_size      = sizeof(struct config_image_header);
+    header->event_size       = sizeof(input_event);
+    header->key_mapping_size = sizeof(key_mapping);
+    header->key_cnt          = KEY_CNT;
+    header->mappings_size    = (uint32_t)mappings_size;
+    header->mappings_offset  = mappings_offset;
+    header->key_index_offset = key_index_offset;
+    header->image_size       = size;
+    header->source_hash      = source_hash;
+
+    // Field by field, so the padding stays zeroed.
+    struct config_settings *dest_settings   = &header->settings;
+    dest_settings->burst_typing_msec        = settings->burst_typing_msec;
+    dest_settings->can_insert_letter_msec   = settings->can_insert_letter_msec;
+    dest_settings->adaptive_burst_min_msec  = settings->adaptive_burst_min_msec;
+    dest_settings->adaptive_burst_max_msec  = settings->adaptive_burst_max_msec;
+    dest_settings->require_prior_idle_msec  = settings->require_prior_idle_msec;
+    dest_settings->key_repeat_delay_msec    = settings->key_repeat_delay_msec;
+    dest_settings->key_repeat_interval_msec =
+        settings->key_repeat_interval_msec;
+    dest_settings->adaptive_burst_typing    = settings->adaptive_burst_typing;
+
+    header->checksum = image_checksum(image, size);
+
+    *image_size = size;
+    return image;
+}
+
+bool config_image_verify(const void *image, size_t image_size,
+                         const char *name) {
+    const struct config_image_header *header = image;
+
+    if (image_size < sizeof(*header) ||
+        !config_image_has_magic(image, image_size)) {
+        fprintf(stderr, "Error: %s is not a compiled config.\n", name);
+        return false;
+    }
+    if (header->version != CONFIG_IMAGE_VERSION ||
+        header->header_size != sizeof(*header) ||
+        header->event_size != sizeof(input_event) ||
+        header->key_mapping_size != sizeof(key_mapping) ||
+        header->key_cnt != KEY_CNT) {
+        fprintf(stderr,
+                "Error: %s was compiled by an incompatible version, compile it "
+                "again.\n",
+                name);
+        return false;
+    }
+
+    const uint64_t mappings_end =
+        header->mappings_offset +
+        (uint64_t)header->mappings_size * sizeof(key_mapping);
+    if (header->image_size != image_size ||
+        header->mappings_offset < sizeof(*header) ||
+        header->mappings_offset % CONFIG_IMAGE_ALIGN != 0 ||
+        header->key_index_offset % CONFIG_IMAGE_ALIGN != 0 ||
+        header->key_index_offset < mappings_end ||
+        header->key_index_offset + KEY_CNT * sizeof(uint16_t) > image_size) {
+        fprintf(stderr, "Error: %s is truncated or malformed.\n", name);
+        return false;
+    }
+    if (header->checksum != image_checksum(image, image_size)) {
+        fprintf(stderr, "Error: checksum mismatch in %s.\n", name);
+        return false;
+    }
+
+    // The checksum only proves the file is what the compiler wrote. Make sure
+    // the index cannot send the engine out of the mapping table either.
+    int mappings_size;
+    const key_mapping *mappings = config_image_mappings(image, &mappings_size);
+    const uint16_t *key_index   = config_image_key_index(image);
+    for (int key = 0; key < KEY_CNT; key++) {
+        if (key_index[key] > mappings_size ||
+            (key_index[key] != 0 && mappings[key_index[key] - 1].key != key)) {
+            fprintf(stderr, "Error: inconsistent key index in %s.\n", name);
+            return false;
+        }
+    }
+    for (int i = 0; i < mappings_size; i++) {
+        if (mappings[i].key >= KEY_CNT ||
+            key_index[mappings[i].key] != i + 1) {
+            fprintf(stderr, "Error: inconsistent key index in %s.\n", name);
+            return false;
+        }
+        // Nor can the events it sends, whose codes index tables too.
+        if (!are_mapping_keys_valid(&mappings[i])) {
+            fprintf(stderr,
+                    "Error: key code out of range in mapping %d of %s.\n",
+                    i + 1, name);
+            return false;
+        }
+    }
+    bool is_invalid = header->settings.burst_typing_msec < 0 ||
+                      header->settings.can_insert_letter_msec < 0 ||
+                      header->settings.adaptive_burst_min_msec < 0 ||
+                      header->settings.adaptive_burst_max_msec <
+                          header->settings.adaptive_burst_min_msec ||
+                      header->settings.require_prior_idle_msec < 0 ||
+                      header->settings.key_repeat_delay_msec < 0 ||
+                      header->settings.key_repeat_interval_msec < 0;
+    for (int i = 0; i < mappings_size; i++) {
+        is_invalid = is_invalid || mappings[i].hand >= HAND_CNT ||
+                     mappings[i].hold_tap_policy >= HOLD_TAP_POLICY_CNT ||
+                     mappings[i].burst_typing_usec < 0 ||
+                     mappings[i].can_insert_letter_usec < 0;
+    }
+    if (is_invalid) {
+        fprintf(stderr, "Error: invalid timeouts, hands or policies in %s.\n",
+                name);
+        return false;
+    }
+    return true;
+}
+
+void *config_image_map(const char *path, size_t *image_size) {
+    struct stat st;
+    void *image;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to open config file: %s\n", path);
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        fprintf(stderr, "Error: %s is empty or unreadable.\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    *image_size = st.st_size;
+    return image;
+}
+
+/* Write the data to path via a uniquely named temporary file, so the readers
+ * (possibly several instances at once) see either the old or the new file. */
+static bool write_file_atomically(const char *path, const void *data,
+                                  size_t size) {
+    char tmp_path[PATH_MAX];
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path) >=
+        (int)sizeof(tmp_path)) {
+        fprintf(stderr, "Error: path too long: %s\n", path);
+        return false;
+    }
+
+    int fd = mkstemp(tmp_path);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to create %s: %s\n", tmp_path, strerror(errno));
+        return false;
+    }
+
+    const char *p = data;
+    bool ok       = fchmod(fd, IMAGE_FILE_MODE) == 0;
+    while (ok && size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        ok = n > 0;
+        if (ok) {
+            p += n;
+            size -= n;
+        }
+    }
+    ok = (close(fd) == 0) && ok;
+    if (!ok || rename(tmp_path, path) == -1) {
+        fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+bool config_image_write(const void *image, size_t image_size,
+                        const char *path) {
+    return write_file_atomically(path, image, image_size);
+}
+
+static void write_event_initializer(FILE *fp, const char *name,
+                                    const input_event *event) {
+    fprintf(fp, "        .%s = {.type = %u, .code = %u, .value = %d},\n", name,
+            event->type, event->code, event->value);
+}
+
+bool config_image_write_header(const void *image, const char *source,
+                               const char *path) {
+    const struct config_settings *settings = config_image_settings(image);
+    const uint16_t *key_index              = config_image_key_index(image);
+    int mappings_size;
+    const key_mapping *mappings = config_image_mappings(image, &mappings_size);
+    char *buf;
+    size_t size;
+
+    FILE *fp = open_memstream(&buf, &size);
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to allocate memory!\n");
+        return false;
+    }
+
+    fprintf(fp,
+            "/* Generated by home-row-fu --generate-header from %s.\n"
+            " * Do not edit. */\n\n"
+            "#define STATIC_CONFIG_MAPPINGS_SIZE %d\n\n"
+            "static const struct config_settings static_config_settings = {\n"
+            "    .burst_typing_msec      = %" PRId64 ",\n"
+            "    .can_insert_letter_msec = %" PRId64 ",\n"
+            "    .adaptive_burst_min_msec = %" PRId64 ",\n"
+            "    .adaptive_burst_max_msec = %" PRId64 ",\n"
+            "    .require_prior_idle_msec = %" PRId64 ",\n"
+            "    .key_repeat_delay_msec = %" PRId64 ",\n"
+            "    .key_repeat_interval_msec = %" PRId64 ",\n"
+            "    .adaptive_burst_typing = %s,\n"
+            "};\n\n",
+            source, mappings_size, settings->burst_typing_msec,
+            settings->can_insert_letter_msec,
+            settings->adaptive_burst_min_msec,
+            settings->adaptive_burst_max_msec,
+            settings->require_prior_idle_msec,
+            settings->key_repeat_delay_msec, settings->key_repeat_interval_msec,
+            settings->adaptive_burst_typing ? "true" : "false");
+
+    // An empty initializer is not valid C, so there is always one entry.
+    fprintf(fp, "static const key_mapping static_key_mappings[] = {\n");
+    if (mappings_size == 0)
+        fprintf(fp, "    {.key = 0},\n");
+    for (int i = 0; i < mappings_size; i++) {
+        fprintf(fp, "    {\n        .key = %u,\n", mappings[i].key);
+        fprintf(fp, "        .immediately_send_modifier = %s,\n",
+                mappings[i].immediately_send_modifier ? "true" : "false");
+        fprintf(fp,
+                "        .hand = %u,\n"
+                "        .hold_tap_policy = %u,\n"
+                "        .bilateral_combinations = %s,\n"
+                "        .speculative_letters = %s,\n"
+                "        .burst_typing_usec = %" PRId64 ",\n"
+                "        .can_insert_letter_usec = %" PRId64 ",\n",
+                mappings[i].hand, mappings[i].hold_tap_policy,
+                mappings[i].bilateral_combinations ? "true" : "false",
+                mappings[i].speculative_letters ? "true" : "false",
+                mappings[i].burst_typing_usec,
+                mappings[i].can_insert_letter_usec);
+        write_event_initializer(fp, "ev_real_down", &mappings[i].ev_real_down);
+        write_event_initializer(fp, "ev_real_up", &mappings[i].ev_real_up);
+        write_event_initializer(fp, "ev_modifier_down",
+                                &mappings[i].ev_modifier_down);
+        write_event_initializer(fp, "ev_modifier_up",
+                                &mappings[i].ev_modifier_up);
+        write_event_initializer(fp, "ev_correction_down",
+                                &mappings[i].ev_correction_down);
+        write_event_initializer(fp, "ev_correction_up",
+                                &mappings[i].ev_correction_up);
+        fprintf(fp, "    },\n");
+    }
+    fprintf(fp, "};\n\n");
+
+    fprintf(fp, "static const uint16_t static_key_index[KEY_CNT] = {\n");
+    for (int key = 0; key < KEY_CNT; key++) {
+        if (key_index[key] != 0)
+            fprintf(fp, "    [%d] = %u,\n", key, key_index[key]);
+    }
+    fprintf(fp, "};\n");
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Failed to allocate memory!\n");
+        free(buf);
+        return false;
+    }
+    bool ok = write_file_atomically(path, buf, size);
+    free(buf);
+    return ok;
+}
+
+/* Path of the cached image of the configuration file. It is named after the
+ * full path of the file rather than its contents, so a new version of the file
+ * replaces the image of the previous one instead of adding up in the cache
+ * (tmpfs, by default). The image version goes into the name too, so the builds
+ * of different versions do not keep replacing each other's image. */
+static bool cache_path(char *buf, size_t buf_size, const char *cache_dir,
+                       const char *config_file) {
+    char full_path[PATH_MAX];
+    if (realpath(config_file, full_path) == NULL)
+        return false;
+
+    uint64_t name_hash =
+        config_image_source_hash(full_path, strlen(full_path));
+    return snprintf(buf, buf_size, "%s/home-row-fu-%016" PRIx64 ".img",
+                    cache_dir, name_hash) < (int)buf_size;
+}
+
+void *config_image_map_cached(const char *cache_dir, const char *config_file,
+                              uint64_t source_hash, size_t *image_size) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (!cache_path(path, sizeof(path), cache_dir, config_file))
+        return NULL;
+
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    // Anyone can drop a file into a shared directory such as /dev/shm, so only
+    // use the images we could have written ourselves.
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+        st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+        st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return NULL;
+
+    // The image of a previous version of the file is replaced once the new
+    // one is compiled.
+    const struct config_image_header *header = image;
+    if (!config_image_verify(image, st.st_size, path) ||
+        header->source_hash != source_hash) {
+        munmap(image, st.st_size);
+        return NULL;
+    }
+
+    *image_size = st.st_size;
+    return image;
+}
+
+bool config_image_cache(const char *cache_dir, const char *config_file,
+                        const void *image, size_t image_size) {
+    char path[PATH_MAX];
+
+    if (!cache_path(path, sizeof(path), cache_dir, config_file)) {
+        fprintf(stderr, "Error: no cache path for %s in %s\n", config_file,
+                cache_dir);
+        return false;
+    }
+    return write_file_atomically(path, image, image_size);
+}
+
+const struct config_settings *config_image_settings(const void *image) {
+    return &((const struct config_image_header *)image)->settings;
+}
+
+const key_mapping *config_image_mappings(const void *image, int *size) {
+    const struct config_image_header *header = image;
+    *size = (int)header->mappings_size;
+    return (const key_mapping *)((const char *)image + header->mappings_offset);
+}
+
+const uint16_t *config_image_key_index(const void *image) {
+    const struct config_image_header *header = image;
+    return (const uint16_t *)((const char *)image + header->key_index_offset);
+}
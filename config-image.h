@@ -0,0 +1,126 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 - 2021 Andriy B. Kmit'
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// Author: Andriy B. Kmit' <dev@madand.net>
+// URL: https://github.com/madand/interception-home-row-fu
+
+/* Compiled configuration image: the mapping table and the index of it by key
+ * code, laid out flat so it can be written to a file and mapped back as is.
+ * All references inside are offsets from the start of the image, so it does
+ * not matter where it gets mapped.
+ *
+ * Layout: struct config_image_header, the key_mapping array, then the key
+ * index (uint16_t[KEY_CNT]), each aligned to CONFIG_IMAGE_ALIGN. */
+
+#ifndef CONFIG_IMAGE_H
+#define CONFIG_IMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "home-row-fu.h"
+
+#define CONFIG_IMAGE_MAGIC "HRFUCFG"
+#define CONFIG_IMAGE_MAGIC_SIZE 8
+/* Bump on any change of the layout below or of struct key_mapping. */
+#define CONFIG_IMAGE_VERSION 10
+
+struct config_image_header {
+    char magic[CONFIG_IMAGE_MAGIC_SIZE];
+    uint32_t version;
+    /* Sizes of the structures the image was built with, so an image from a
+     * different architecture or build gets rejected. */
+    uint32_t header_size;
+    uint32_t event_size;
+    uint32_t key_mapping_size;
+    uint32_t key_cnt;
+    uint32_t mappings_size;
+    uint64_t mappings_offset;
+    uint64_t key_index_offset;
+    uint64_t image_size;
+    /* FNV-1a hash of the whole image, computed with this field set to 0. */
+    uint64_t checksum;
+    /* Hash of the TOML file the image was compiled from. */
+    uint64_t source_hash;
+    struct config_settings settings;
+};
+
+/* Return true if data starts with the image magic. */
+bool config_image_has_magic(const void *data, size_t size);
+
+/* Hash of the TOML source of an image. Also covers the image version, so a
+ * new version of the image never gets mixed up with an old one. */
+uint64_t config_image_source_hash(const void *source, size_t source_size);
+
+/* Build an image of the given settings and mappings in a freshly allocated
+ * buffer. Return NULL after printing the reason to STDERR if the mappings are
+ * invalid. */
+void *config_image_build(const struct config_settings *settings,
+                         const key_mapping *mappings, int mappings_size,
+                         uint64_t source_hash, size_t *image_size);
+
+/* Check that the image is complete, intact and was built for this very
+ * program. Print the reason to STDERR and return false otherwise. */
+bool config_image_verify(const void *image, size_t image_size,
+                         const char *name);
+
+/* Map the image file read-only. Return NULL after printing the reason to
+ * STDERR on failure. The image is not verified. */
+void *config_image_map(const char *path, size_t *image_size);
+
+/* Write the image to path atomically, via a temporary file. */
+bool config_image_write(const void *image, size_t image_size,
+                        const char *path);
+
+/* Write the image as a C header of constant tables to path, for building the
+ * plugin with the configuration compiled in (-DSTATIC_CONFIG). source is the
+ * name of the configuration file, for the reference. */
+bool config_image_write_header(const void *image, const char *source,
+                               const char *path);
+
+/* Shared image cache. Every instance compiling the same TOML file maps the
+ * same file in cache_dir, one per configuration file, so the tables are in
+ * memory only once and only the first instance pays for the parsing. The
+ * source hash in the image tells whether it is of the current version of the
+ * file. */
+
+/* Map the cached image of the configuration file, if it is of the source with
+ * the given hash. Return NULL if there is none, or it is of another version of
+ * the file, or it cannot be trusted (foreign owner, writable by others, fails
+ * verification). */
+void *config_image_map_cached(const char *cache_dir, const char *config_file,
+                              uint64_t source_hash, size_t *image_size);
+
+/* Store the image of the configuration file in the cache, replacing the one
+ * of its previous version. */
+bool config_image_cache(const char *cache_dir, const char *config_file,
+                        const void *image, size_t image_size);
+
+/* Accessors of a verified image. */
+const struct config_settings *config_image_settings(const void *image);
+const key_mapping *config_image_mappings(const void *image, int *size);
+const uint16_t *config_image_key_index(const void *image);
+
+#endif /* CONFIG_IMAGE_H */
@@ -0,0 +1,588 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 - 2021 Andriy B. Kmit'
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// Author: Andriy B. Kmit' <dev@madand.net>
+// URL: https://github.com/madand/interception-home-row-fu
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lib/toml.h"
+
+#include "config-image.h"
+#include "config-toml.h"
+#include "hands.h"
+#include "home-row-fu.h"
+
+/* Copy a raw value, which is not NUL terminated in the source, into buf.
+ * Return false if it does not fit. */
+static bool copy_raw_value(const char *raw, int raw_len, char *buf) {
+    if (raw_len >= CONFIG_VALUE_SIZE)
+        return false;
+    memcpy(buf, raw, raw_len);
+    buf[raw_len] = '\0';
+    return true;
+}
+
+/* Read an integer value into ret. */
+static void read_config_int(const char *key, const char *raw, int raw_len,
+                            int64_t *ret) {
+    char buf[CONFIG_VALUE_SIZE];
+    int64_t maybe_ret;
+    if (copy_raw_value(raw, raw_len, buf) && toml_rtoi(buf, &maybe_ret) != -1) {
+        if (maybe_ret >= 0) {
+            *ret = maybe_ret;
+        } else {
+            fprintf(stderr, "Warning: ignoring negative value (%ld) for %s\n",
+                    maybe_ret, key);
+        }
+    }
+}
+
+/* Read a boolean value into ret. If the value cannot be read, ret keeps its
+ * default. */
+static void read_config_bool(const char *raw, int raw_len, bool *ret) {
+    char buf[CONFIG_VALUE_SIZE];
+    int maybe_ret;
+    if (copy_raw_value(raw, raw_len, buf) && toml_rtob(buf, &maybe_ret) != -1)
+        *ret = maybe_ret;
+}
+
+struct key_name {
+    char name[KEY_NAME_SIZE];
+    uint16_t code;
+};
+
+/* All the KEY_* and BTN_* names, sorted. Generated from input-event-codes.h by
+ * the build. The names are stored inline rather than as pointers, so the table
+ * needs no relocations at startup. */
+static const struct key_name key_names[] = {
+#include "key-names.h"
+};
+
+static int compare_key_names(const void *name, const void *entry) {
+    return strcmp(name, ((const struct key_name *)entry)->name);
+}
+
+/* Return the code of the key with the given name (e.g. "KEY_F"), or -1 if
+ * there is no such key. */
+static int key_code_from_name(const char *name) {
+    const struct key_name *found =
+        bsearch(name, key_names, sizeof(key_names) / sizeof(*key_names),
+                sizeof(*key_names), compare_key_names);
+    return found != NULL ? found->code : -1;
+}
+
+/* Read a key code into ret. Supports reading an integer or a string (e.g.
+ * "KEY_F"). Return false if the value is invalid. */
+static bool read_config_key_code(const char *key, const char *raw,
+                                 int raw_len, uint16_t *ret) {
+    char buf[CONFIG_VALUE_SIZE];
+    int64_t maybe_ret;
+
+    if (!copy_raw_value(raw, raw_len, buf)) {
+        fprintf(stderr, "Error: unknown value of %s.\n", key);
+        return false;
+    }
+
+    // First try to read it as int
+    if (toml_rtoi(buf, &maybe_ret) != -1) {
+        if (maybe_ret >= 0) {
+            *ret = (uint16_t)maybe_ret;
+            return true;
+        } else {
+            fprintf(stderr, "Error: %s is negative.\n", key);
+            return false;
+        }
+    }
+
+    // If not int, it might be a string key code name. Only names with escapes
+    // need to be copied by toml_rtos().
+    const char *name;
+    int name_len;
+    char *key_code_str = NULL;
+    if (toml_vtos(raw, raw_len, &name, &name_len) != -1) {
+        buf[name_len + 1] = '\0';
+        name              = buf + 1;
+    } else if (toml_rtos(buf, &key_code_str) != -1) {
+        name = key_code_str;
+    } else {
+        fprintf(stderr,
+                "Error: unknown value of %s. Must be integer or string.\n",
+                key);
+        return false;
+    }
+
+    maybe_ret = key_code_from_name(name);
+    if (maybe_ret >= 0)
+        *ret = (uint16_t)maybe_ret;
+    else
+        fprintf(stderr, "Error: unknown key name %s\n", name);
+    free(key_code_str);
+    return maybe_ret >= 0;
+}
+
+/* A [[mapping]] as read from the source. The key values are raw views into the
+ * source until they get resolved. */
+struct mapping_source {
+    const char *physical_key, *modifier_key;  // NULL if not set
+    int physical_key_len, modifier_key_len;
+    uint16_t physical_key_code, modifier_key_code;
+    bool immediately_send_modifier;
+    uint8_t hand;
+    // enum hold_tap_policy, -1 if not set.
+    int hold_tap_policy;
+    bool bilateral_combinations;
+    bool speculative_letters;
+    // Overrides of the thresholds, -1 if not set.
+    int64_t burst_typing_msec, can_insert_letter_msec;
+};
+
+/* The configuration as it is read from the TOML token stream. */
+struct config_toml {
+    struct config_settings settings;
+    // Defaults of the [hand.left] and [hand.right] tables, -1 if not set.
+    struct config_settings hand_settings[HAND_CNT];
+    // Policy of the mappings which do not set one.
+    uint8_t hold_tap_policy;
+    // Defaults of bilateral_combinations and speculative_letters for the
+    // mappings.
+    bool bilateral_combinations;
+    bool speculative_letters;
+    // Key taking back the speculative letters: a raw view until resolved.
+    const char *correction_key;  // NULL if not set
+    int correction_key_len;
+    uint16_t correction_key_code;
+    struct mapping_source *mappings;
+    int mappings_size, mappings_capacity;
+    // The last mapping is being read.
+    bool in_mapping;
+};
+
+/* Start a new [[mapping]]. */
+static bool add_config_mapping(struct config_toml *reader) {
+    if (reader->mappings_size == reader->mappings_capacity) {
+        int capacity = reader->mappings_capacity > 0
+                           ? 2 * reader->mappings_capacity
+                           : CONFIG_MAPPINGS_CAPACITY;
+        struct mapping_source *grown =
+            realloc(reader->mappings, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            fprintf(stderr, "Failed to allocate memory!\n");
+            return false;
+        }
+        reader->mappings          = grown;
+        reader->mappings_capacity = capacity;
+    }
+
+    reader->mappings[reader->mappings_size++] = (struct mapping_source){
+        .immediately_send_modifier = DEFAULT_IMMEDIATELY_SEND_MODIFIER,
+        .hand                      = HAND_NONE,
+        .hold_tap_policy           = -1,
+        .bilateral_combinations    = reader->bilateral_combinations,
+        .speculative_letters       = reader->speculative_letters,
+        .burst_typing_msec         = -1,
+        .can_insert_letter_msec    = -1,
+    };
+    return true;
+}
+
+/* Called back for every table header of the config. Return 0 to go on, or
+ * CONFIG_READ_FAILED after printing the reason. */
+static int read_config_table(void *arg, const char *const *path, int depth,
+                             int array) {
+    struct config_toml *reader = arg;
+
+    reader->in_mapping =
+        array && depth == 1 && strcmp(path[0], "mapping") == 0;
+    if (reader->in_mapping && !add_config_mapping(reader))
+        return CONFIG_READ_FAILED;
+    return 0;
+}
+
+/* Return the hand with the given name, or HAND_NONE if there is no such. */
+static enum key_hand hand_from_name(const char *name, int name_len) {
+    if (name_len == 4 && memcmp(name, "left", 4) == 0)
+        return HAND_LEFT;
+    if (name_len == 5 && memcmp(name, "right", 5) == 0)
+        return HAND_RIGHT;
+    return HAND_NONE;
+}
+
+/* Read a hand name ("left" or "right") into ret. Return false if the value is
+ * invalid. */
+static bool read_config_hand(const char *key, const char *raw, int raw_len,
+                             uint8_t *ret) {
+    const char *name;
+    int name_len;
+    enum key_hand hand = HAND_NONE;
+
+    if (toml_vtos(raw, raw_len, &name, &name_len) != -1)
+        hand = hand_from_name(name, name_len);
+    if (hand == HAND_NONE) {
+        fprintf(stderr, "Error: %s must be \"left\" or \"right\".\n", key);
+        return false;
+    }
+    *ret = hand;
+    return true;
+}
+
+/* Names of the hold/tap policies, by enum hold_tap_policy. */
+static const char *const hold_tap_policy_names[HOLD_TAP_POLICY_CNT] = {
+    [HOLD_TAP_TIMER]                   = "timer",
+    [HOLD_TAP_HOLD_ON_OTHER_KEY_PRESS] = "hold-on-other-key-press",
+    [HOLD_TAP_PERMISSIVE_HOLD]         = "permissive-hold",
+    [HOLD_TAP_BALANCED]                = "balanced",
+};
+
+/* Read a hold/tap policy name into ret. Return false if the value is
+ * invalid. */
+static bool read_config_hold_tap_policy(const char *key, const char *raw,
+                                        int raw_len, int *ret) {
+    const char *name;
+    int name_len;
+
+    if (toml_vtos(raw, raw_len, &name, &name_len) != -1) {
+        for (int policy = 0; policy < HOLD_TAP_POLICY_CNT; policy++) {
+            if ((int)strlen(hold_tap_policy_names[policy]) == name_len &&
+                memcmp(hold_tap_policy_names[policy], name, name_len) == 0) {
+                *ret = policy;
+                return true;
+            }
+        }
+    }
+    fprintf(stderr,
+            "Error: %s must be \"timer\", \"hold-on-other-key-press\", "
+            "\"permissive-hold\" or \"balanced\".\n",
+            key);
+    return false;
+}
+
+/* Read a threshold of the settings, if key is one. */
+static void read_config_threshold(const char *key, const char *raw,
+                                  int raw_len,
+                                  struct config_settings *settings) {
+    if (strcmp(key, "burst_typing_msec") == 0) {
+        read_config_int(key, raw, raw_len, &settings->burst_typing_msec);
+    } else if (strcmp(key, "can_insert_letter_msec") == 0) {
+        read_config_int(key, raw, raw_len, &settings->can_insert_letter_msec);
+    }
+}
+
+/* Called back for every key/value of the config. Return 0 to go on, or
+ * CONFIG_READ_FAILED after printing the reason. */
+static int read_config_value(void *arg, const char *const *path, int depth,
+                             const char *key, const char *raw, int raw_len) {
+    struct config_toml *reader = arg;
+
+    if (depth == 0) {
+        struct config_settings *settings = &reader->settings;
+        if (strcmp(key, "adaptive_burst_typing") == 0) {
+            read_config_bool(raw, raw_len, &settings->adaptive_burst_typing);
+        } else if (strcmp(key, "adaptive_burst_min_msec") == 0) {
+            read_config_int(key, raw, raw_len,
+                            &settings->adaptive_burst_min_msec);
+        } else if (strcmp(key, "adaptive_burst_max_msec") == 0) {
+            read_config_int(key, raw, raw_len,
+                            &settings->adaptive_burst_max_msec);
+        } else if (strcmp(key, "require_prior_idle_msec") == 0) {
+            read_config_int(key, raw, raw_len,
+                            &settings->require_prior_idle_msec);
+        } else if (strcmp(key, "key_repeat_delay_msec") == 0) {
+            read_config_int(key, raw, raw_len,
+                            &settings->key_repeat_delay_msec);
+        } else if (strcmp(key, "key_repeat_interval_msec") == 0) {
+            read_config_int(key, raw, raw_len,
+                            &settings->key_repeat_interval_msec);
+        } else if (strcmp(key, "hold_tap_policy") == 0) {
+            int policy;
+            if (!read_config_hold_tap_policy(key, raw, raw_len, &policy))
+                return CONFIG_READ_FAILED;
+            reader->hold_tap_policy = policy;
+        } else if (strcmp(key, "bilateral_combinations") == 0) {
+            read_config_bool(raw, raw_len, &reader->bilateral_combinations);
+        } else if (strcmp(key, "speculative_letters") == 0) {
+            read_config_bool(raw, raw_len, &reader->speculative_letters);
+        } else if (strcmp(key, "correction_key") == 0) {
+            reader->correction_key     = raw;
+            reader->correction_key_len = raw_len;
+        } else {
+            read_config_threshold(key, raw, raw_len, settings);
+        }
+        return 0;
+    }
+
+    // Defaults of the keys typed with one hand: [hand.left], [hand.right].
+    if (depth == 2 && strcmp(path[0], "hand") == 0) {
+        enum key_hand hand = hand_from_name(path[1], strlen(path[1]));
+        if (hand != HAND_NONE)
+            read_config_threshold(key, raw, raw_len,
+                                  &reader->hand_settings[hand]);
+        return 0;
+    }
+
+    // Keys of a [[mapping]], but not of tables nested in it.
+    if (!reader->in_mapping || depth != 1 || strcmp(path[0], "mapping") != 0)
+        return 0;
+
+    struct mapping_source *mapping =
+        &reader->mappings[reader->mappings_size - 1];
+    if (strcmp(key, "physical_key") == 0) {
+        mapping->physical_key     = raw;
+        mapping->physical_key_len = raw_len;
+    } else if (strcmp(key, "modifier_key") == 0) {
+        mapping->modifier_key     = raw;
+        mapping->modifier_key_len = raw_len;
+    } else if (strcmp(key, "immediately_send_modifier") == 0) {
+        read_config_bool(raw, raw_len, &mapping->immediately_send_modifier);
+    } else if (strcmp(key, "hand") == 0) {
+        if (!read_config_hand(key, raw, raw_len, &mapping->hand))
+            return CONFIG_READ_FAILED;
+    } else if (strcmp(key, "hold_tap_policy") == 0) {
+        if (!read_config_hold_tap_policy(key, raw, raw_len,
+                                         &mapping->hold_tap_policy))
+            return CONFIG_READ_FAILED;
+    } else if (strcmp(key, "bilateral_combinations") == 0) {
+        read_config_bool(raw, raw_len, &mapping->bilateral_combinations);
+    } else if (strcmp(key, "speculative_letters") == 0) {
+        read_config_bool(raw, raw_len, &mapping->speculative_letters);
+    } else if (strcmp(key, "burst_typing_msec") == 0) {
+        read_config_int(key, raw, raw_len, &mapping->burst_typing_msec);
+    } else if (strcmp(key, "can_insert_letter_msec") == 0) {
+        read_config_int(key, raw, raw_len, &mapping->can_insert_letter_msec);
+    }
+    return 0;
+}
+
+/* Resolve the key values of the mapping to key codes. */
+static bool resolve_config_mapping(struct mapping_source *mapping) {
+    if (mapping->physical_key == NULL || mapping->modifier_key == NULL) {
+        fprintf(stderr, "Error: %s is not set.\n",
+                mapping->physical_key == NULL ? "physical_key"
+                                              : "modifier_key");
+        return false;
+    }
+    return read_config_key_code("physical_key", mapping->physical_key,
+                                mapping->physical_key_len,
+                                &mapping->physical_key_code) &&
+           read_config_key_code("modifier_key", mapping->modifier_key,
+                                mapping->modifier_key_len,
+                                &mapping->modifier_key_code);
+}
+
+/* Return the threshold in microseconds: the one set by the mapping, or else by
+ * its hand, or else the global one. */
+static int64_t resolve_threshold_usec(int64_t mapping_msec, int64_t hand_msec,
+                                      int64_t global_msec) {
+    int64_t msec = mapping_msec >= 0 ? mapping_msec
+                   : hand_msec >= 0  ? hand_msec
+                                     : global_msec;
+    return msec * US_PER_MS;
+}
+
+/* Initialize the mapping according to its source. */
+static void init_single_mapping(const struct config_toml *config,
+                                const struct mapping_source *source,
+                                key_mapping *mapping) {
+    uint16_t key_code      = source->physical_key_code;
+    uint16_t modifier_code = source->modifier_key_code;
+    // Without a hand of its own, the key is typed with the one of its position.
+    uint8_t hand_index = source->hand != HAND_NONE
+                             ? source->hand
+                             : key_position_hand(key_code);
+    const struct config_settings *hand = &config->hand_settings[hand_index];
+
+    // clang-format off
+    *mapping = (key_mapping){
+        .key = key_code,
+        .immediately_send_modifier = source->immediately_send_modifier,
+        .hand = hand_index,
+        .hold_tap_policy = source->hold_tap_policy >= 0
+                               ? source->hold_tap_policy
+                               : config->hold_tap_policy,
+        .bilateral_combinations = source->bilateral_combinations,
+        .speculative_letters = source->speculative_letters,
+        .burst_typing_usec = resolve_threshold_usec(
+            source->burst_typing_msec, hand->burst_typing_msec,
+            config->settings.burst_typing_msec),
+        .can_insert_letter_usec = resolve_threshold_usec(
+            source->can_insert_letter_msec, hand->can_insert_letter_msec,
+            config->settings.can_insert_letter_msec),
+        .ev_real_down     = {
+            .type  = EV_KEY,
+            .code  = key_code,
+            .value = EVENT_VALUE_KEY_DOWN
+        },
+        .ev_real_up       = {
+            .type  = EV_KEY,
+            .code  = key_code,
+            .value = EVENT_VALUE_KEY_UP
+        },
+        .ev_modifier_down = {
+            .type  = EV_KEY,
+            .code  = modifier_code,
+            .value = EVENT_VALUE_KEY_DOWN
+        },
+        .ev_modifier_up   = {
+            .type  = EV_KEY,
+            .code  = modifier_code,
+            .value = EVENT_VALUE_KEY_UP
+        },
+        .ev_correction_down = {
+            .type  = EV_KEY,
+            .code  = config->correction_key_code,
+            .value = EVENT_VALUE_KEY_DOWN
+        },
+        .ev_correction_up   = {
+            .type  = EV_KEY,
+            .code  = config->correction_key_code,
+            .value = EVENT_VALUE_KEY_UP
+        },
+    };
+    // clang-format on
+}
+
+static uint64_t monotonic_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct config_toml *config_toml_read(char *source, const char *config_file,
+                                     struct config_toml_stats *stats) {
+    char err_buf[TOML_ERROR_BUFFER_SIZE];
+    struct config_toml *config = calloc(1, sizeof(*config));
+    if (config == NULL) {
+        fprintf(stderr, "Failed to allocate memory!\n");
+        return NULL;
+    }
+    config->settings = (struct config_settings){
+        .burst_typing_msec        = DEFAULT_BURST_TYPING_MSEC,
+        .can_insert_letter_msec   = DEFAULT_CAN_INSERT_LETTER_MSEC,
+        .adaptive_burst_min_msec  = DEFAULT_ADAPTIVE_BURST_MIN_MSEC,
+        .adaptive_burst_max_msec  = DEFAULT_ADAPTIVE_BURST_MAX_MSEC,
+        .require_prior_idle_msec  = DEFAULT_REQUIRE_PRIOR_IDLE_MSEC,
+        .key_repeat_delay_msec    = DEFAULT_KEY_REPEAT_DELAY_MSEC,
+        .key_repeat_interval_msec = DEFAULT_KEY_REPEAT_INTERVAL_MSEC,
+        .adaptive_burst_typing    = DEFAULT_ADAPTIVE_BURST_TYPING,
+    };
+    config->hold_tap_policy        = DEFAULT_HOLD_TAP_POLICY;
+    config->bilateral_combinations = DEFAULT_BILATERAL_COMBINATIONS;
+    config->speculative_letters    = DEFAULT_SPECULATIVE_LETTERS;
+    config->correction_key_code    = DEFAULT_CORRECTION_KEY;
+    for (int hand = 0; hand < HAND_CNT; hand++)
+        config->hand_settings[hand] = (struct config_settings){
+            .burst_typing_msec = -1, .can_insert_letter_msec = -1};
+    const toml_stream_t stream = {
+        .table  = read_config_table,
+        .keyval = read_config_value,
+        .arg    = config,
+    };
+
+    uint64_t start = monotonic_nsec();
+    int rc = toml_parse_stream(source, &stream, err_buf, sizeof(err_buf));
+    if (rc == -1)
+        fprintf(stderr, "Failed to parse config file: %s\nError: %s\n",
+                config_file, err_buf);
+    if (rc != 0)
+        goto fail;
+    if (config->settings.adaptive_burst_min_msec >
+        config->settings.adaptive_burst_max_msec) {
+        fprintf(stderr, "Error: adaptive_burst_min_msec is greater than "
+                        "adaptive_burst_max_msec.\n");
+        goto fail;
+    }
+
+    uint64_t parsed = monotonic_nsec();
+    for (int i = 0; i < config->mappings_size; i++) {
+        if (!resolve_config_mapping(&config->mappings[i]))
+            goto fail;
+    }
+    if (config->correction_key != NULL &&
+        !read_config_key_code("correction_key", config->correction_key,
+                              config->correction_key_len,
+                              &config->correction_key_code))
+        goto fail;
+
+    if (stats != NULL) {
+        stats->parse_nsec   = parsed - start;
+        stats->resolve_nsec = monotonic_nsec() - parsed;
+    }
+    return config;
+
+fail:
+    config_toml_free(config);
+    return NULL;
+}
+
+void *config_toml_build(const struct config_toml *config,
+                        uint64_t source_hash, size_t *image_size,
+                        struct config_toml_stats *stats) {
+    key_mapping *mappings = NULL;
+    void *image           = NULL;
+    uint64_t start        = monotonic_nsec();
+
+    if (config->mappings_size == 0)
+        fprintf(stderr, "Warning: no mappings found in the config file.\n"
+                        "The plugin will work as no-op!\n");
+
+    if (config->mappings_size > 0) {
+        mappings = malloc(config->mappings_size * sizeof(*mappings));
+        if (mappings == NULL) {
+            fprintf(stderr, "Failed to allocate memory!\n");
+            return NULL;
+        }
+    }
+    for (int i = 0; i < config->mappings_size; i++)
+        init_single_mapping(config, &config->mappings[i], &mappings[i]);
+
+    image = config_image_build(&config->settings, mappings,
+                               config->mappings_size, source_hash, image_size);
+    free(mappings);
+
+    if (stats != NULL)
+        stats->setup_nsec = monotonic_nsec() - start;
+    return image;
+}
+
+void config_toml_free(struct config_toml *config) {
+    if (config == NULL)
+        return;
+    free(config->mappings);
+    free(config);
+}
+
+void *config_toml_compile(char *source, uint64_t source_hash,
+                          const char *config_file, size_t *image_size) {
+    struct config_toml *config = config_toml_read(source, config_file, NULL);
+    if (config == NULL)
+        return NULL;
+
+    void *image = config_toml_build(config, source_hash, image_size, NULL);
+    config_toml_free(config);
+    return image;
+}
@@ -0,0 +1,68 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 - 2021 Andriy B. Kmit'
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// Author: Andriy B. Kmit' <dev@madand.net>
+// URL: https://github.com/madand/interception-home-row-fu
+
+/* Compilation of the TOML configuration into an image. The mappings are read
+ * straight from the token stream of the parser, without building the TOML
+ * tables, and their key names are resolved once the whole file has been
+ * parsed. */
+
+#ifndef CONFIG_TOML_H
+#define CONFIG_TOML_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Time spent in the phases of compiling a config, in nanoseconds. */
+struct config_toml_stats {
+    uint64_t parse_nsec;    // tokenizing, reading the settings
+    uint64_t resolve_nsec;  // key names and numbers to key codes
+    uint64_t setup_nsec;    // the mapping table and the image of it
+};
+
+/* The settings and mappings read from a TOML source. */
+struct config_toml;
+
+/* Parse the NUL terminated TOML source and resolve its key names. config_file
+ * names the source in the messages. Fill in the parse and resolve times of
+ * stats unless it is NULL. Return NULL on failure, after printing the reason
+ * to STDERR. */
+struct config_toml *config_toml_read(char *source, const char *config_file,
+                                     struct config_toml_stats *stats);
+
+/* Build the image of the config, see config_image_build(). Fill in the setup
+ * time of stats unless it is NULL. */
+void *config_toml_build(const struct config_toml *config,
+                        uint64_t source_hash, size_t *image_size,
+                        struct config_toml_stats *stats);
+
+void config_toml_free(struct config_toml *config);
+
+/* Read and build in one go. */
+void *config_toml_compile(char *source, uint64_t source_hash,
+                          const char *config_file, size_t *image_size);
+
+#endif /* CONFIG_TOML_H */
@@ -0,0 +1,66 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 - 2021 Andriy B. Kmit'
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// Author: Andriy B. Kmit' <dev@madand.net>
+// URL: https://github.com/madand/interception-home-row-fu
+
+#include "hands.h"
+
+// clang-format off
+const uint8_t key_hands[KEY_CNT] = {
+    [KEY_GRAVE] = HAND_LEFT,       [KEY_1] = HAND_LEFT,
+    [KEY_2] = HAND_LEFT,           [KEY_3] = HAND_LEFT,
+    [KEY_4] = HAND_LEFT,           [KEY_5] = HAND_LEFT,
+    [KEY_TAB] = HAND_LEFT,         [KEY_Q] = HAND_LEFT,
+    [KEY_W] = HAND_LEFT,           [KEY_E] = HAND_LEFT,
+    [KEY_R] = HAND_LEFT,           [KEY_T] = HAND_LEFT,
+    [KEY_CAPSLOCK] = HAND_LEFT,    [KEY_A] = HAND_LEFT,
+    [KEY_S] = HAND_LEFT,           [KEY_D] = HAND_LEFT,
+    [KEY_F] = HAND_LEFT,           [KEY_G] = HAND_LEFT,
+    [KEY_LEFTSHIFT] = HAND_LEFT,   [KEY_102ND] = HAND_LEFT,
+    [KEY_Z] = HAND_LEFT,           [KEY_X] = HAND_LEFT,
+    [KEY_C] = HAND_LEFT,           [KEY_V] = HAND_LEFT,
+    [KEY_B] = HAND_LEFT,           [KEY_LEFTCTRL] = HAND_LEFT,
+    [KEY_LEFTMETA] = HAND_LEFT,    [KEY_LEFTALT] = HAND_LEFT,
+    [KEY_ESC] = HAND_LEFT,
+
+    [KEY_6] = HAND_RIGHT,          [KEY_7] = HAND_RIGHT,
+    [KEY_8] = HAND_RIGHT,          [KEY_9] = HAND_RIGHT,
+    [KEY_0] = HAND_RIGHT,          [KEY_MINUS] = HAND_RIGHT,
+    [KEY_EQUAL] = HAND_RIGHT,      [KEY_BACKSPACE] = HAND_RIGHT,
+    [KEY_Y] = HAND_RIGHT,          [KEY_U] = HAND_RIGHT,
+    [KEY_I] = HAND_RIGHT,          [KEY_O] = HAND_RIGHT,
+    [KEY_P] = HAND_RIGHT,          [KEY_LEFTBRACE] = HAND_RIGHT,
+    [KEY_RIGHTBRACE] = HAND_RIGHT, [KEY_BACKSLASH] = HAND_RIGHT,
+    [KEY_H] = HAND_RIGHT,          [KEY_J] = HAND_RIGHT,
+    [KEY_K] = HAND_RIGHT,          [KEY_L] = HAND_RIGHT,
+    [KEY_SEMICOLON] = HAND_RIGHT,  [KEY_APOSTROPHE] = HAND_RIGHT,
+    [KEY_ENTER] = HAND_RIGHT,      [KEY_N] = HAND_RIGHT,
+    [KEY_M] = HAND_RIGHT,          [KEY_COMMA] = HAND_RIGHT,
+    [KEY_DOT] = HAND_RIGHT,        [KEY_SLASH] = HAND_RIGHT,
+    [KEY_RIGHTSHIFT] = HAND_RIGHT, [KEY_RIGHTALT] = HAND_RIGHT,
+    [KEY_RIGHTMETA] = HAND_RIGHT,  [KEY_COMPOSE] = HAND_RIGHT,
+    [KEY_RIGHTCTRL] = HAND_RIGHT,
+};
+// clang-format on
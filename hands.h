@@ -0,0 +1,48 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 - 2021 Andriy B. Kmit'
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// Author: Andriy B. Kmit' <dev@madand.net>
+// URL: https://github.com/madand/interception-home-row-fu
+
+/* Hand the keys are typed with in touch typing, for the per-hand thresholds
+ * and the bilateral combinations. The key codes name positions on the
+ * keyboard, so this holds for any layout. */
+
+#ifndef HANDS_H
+#define HANDS_H
+
+#include <stdint.h>
+#include <linux/input.h>
+
+#include "home-row-fu.h"
+
+/* Hands by key code, HAND_NONE for the keys of both hands, as the space bar. */
+extern const uint8_t key_hands[KEY_CNT];
+
+/* Return the hand of the key by its position. */
+static inline uint8_t key_position_hand(uint16_t key_code) {
+    return key_code < KEY_CNT ? key_hands[key_code] : HAND_NONE;
+}
+
+#endif
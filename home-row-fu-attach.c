@@ -0,0 +1,124 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 - 2021 Andriy B. Kmit'
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// Author: Andriy B. Kmit' <dev@madand.net>
+// URL: https://github.com/madand/interception-home-row-fu
+
+/* Attach client of the home-row-fu daemon (home-row-fu --daemon SOCKET).
+ *
+ * Usage: home-row-fu-attach [SOCKET]
+ *
+ * Drop-in replacement of home-row-fu in an Interception Tools pipeline: hands
+ * its STDIN and STDOUT over to an already running worker of the daemon, waits
+ * until the worker is done with them and exits with its exit status. It has
+ * no dependencies, so it starts faster than the plugin itself would, and
+ * there is no configuration to load at all. */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "home-row-fu.h"
+
+static int connect_to_daemon(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "Failed to connect to %s: %s\n", path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Send STDIN and STDOUT over the socket. */
+static int send_std_fds(int fd) {
+    char byte        = 0;
+    int fds[2]       = {STDIN_FILENO, STDOUT_FILENO};
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    memset(&control, 0, sizeof(control));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level     = SOL_SOCKET;
+    cmsg->cmsg_type      = SCM_RIGHTS;
+    cmsg->cmsg_len       = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(fd, &msg, 0) != 1) {
+        fprintf(stderr, "Failed to hand over STDIN and STDOUT: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+        fprintf(stderr, "Usage: %s [SOCKET]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *path = argc == 2 ? argv[1] : DEFAULT_DAEMON_SOCKET;
+
+    int fd = connect_to_daemon(path);
+    if (fd == -1 || send_std_fds(fd) == -1)
+        return EXIT_FAILURE;
+
+    // The worker has its own copies now. Closing ours lets the reader of
+    // STDOUT see EOF as soon as the worker is done.
+    close(STDIN_FILENO);
+    close(STDOUT_FILENO);
+
+    unsigned char status;
+    ssize_t n;
+    do {
+        n = read(fd, &status, sizeof(status));
+    } while (n == -1 && errno == EINTR);
+    if (n != sizeof(status)) {
+        fprintf(stderr, "The daemon worker exited unexpectedly\n");
+        return EXIT_FAILURE;
+    }
+    return status;
+}
@@ -0,0 +1,223 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 - 2021 Andriy B. Kmit'
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// Author: Andriy B. Kmit' <dev@madand.net>
+// URL: https://github.com/madand/interception-home-row-fu
+
+/* Learn the bigram timing table of home-row-fu from recorded typing.
+ *
+ * Usage: home-row-fu-bigrams [-n SAMPLES] [-p PERCENTILE] OUTPUT TRACE...
+ *
+ * The traces are raw input event streams of the keyboard, as recorded by
+ * `intercept -g DEVNODE > TRACE`, before any plugin. In a roll the key is
+ * still held when the next one goes down, and released before it; the time
+ * from its press to the press of the next key is how long the burst typing
+ * window must be for it to stay a letter. For every pair of a key and the key
+ * pressed right before it, the window is set to cover PERCENTILE (95 by
+ * default) of these times, if there are at least SAMPLES (10 by default) of
+ * them. The other pairs keep the burst typing window of the configuration. */
+
+#include <errno.h>
+#include <inttypes.h>  // PRIu64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "home-row-fu.h"
+#include "bigrams.h"
+
+#define DEFAULT_MIN_SAMPLES 10
+#define DEFAULT_PERCENTILE 95
+/* Width of the histogram buckets of the roll times, and their number. Longer
+ * rolls are not learned. */
+#define BUCKET_MSEC 10
+#define BUCKETS 100
+/* A key pressed later than this after the previous one starts over. */
+#define STREAK_GAP_MSEC 1000
+
+/* The press of a key being followed. */
+struct press {
+    int64_t down_usec;
+    /* Compact code of the key pressed right before, -1 after a pause. */
+    int prev;
+    /* Key pressed first while this one is held, and when. */
+    uint16_t next;
+    int64_t next_down_usec;
+    bool has_next;
+    bool is_held;
+};
+
+static struct press presses[KEY_CNT];
+static int64_t last_down_usec;
+static uint16_t last_down_code;
+static bool has_last_down = false;
+
+/* Histograms of the roll times by the compact codes of the pair. */
+static uint32_t rolls[BIGRAM_KEYS][BIGRAM_KEYS][BUCKETS];
+static uint64_t rolls_total = 0;
+
+static struct bigram_table table;
+
+static void key_down(uint16_t code, int64_t now) {
+    for (int key = 0; key < KEY_CNT; key++) {
+        struct press *held = &presses[key];
+        if (held->is_held && !held->has_next && key != code) {
+            held->next           = code;
+            held->next_down_usec = now;
+            held->has_next       = true;
+        }
+    }
+
+    presses[code] = (struct press){
+        .down_usec = now,
+        .prev      = has_last_down &&
+                        now - last_down_usec <= STREAK_GAP_MSEC * US_PER_MS
+                         ? bigram_key(last_down_code)
+                         : -1,
+        .is_held   = true,
+    };
+    last_down_usec = now;
+    last_down_code = code;
+    has_last_down  = true;
+}
+
+static void key_up(uint16_t code) {
+    struct press *press = &presses[code];
+    if (!press->is_held)
+        return;
+    press->is_held = false;
+
+    // A roll only if the next key is still held: otherwise it is a chord.
+    if (press->prev < 0 || !press->has_next || !presses[press->next].is_held)
+        return;
+    int64_t bucket =
+        (press->next_down_usec - press->down_usec) / (BUCKET_MSEC * US_PER_MS);
+    if (bucket < 0 || bucket >= BUCKETS)
+        return;
+    rolls[press->prev][bigram_key(code)][bucket]++;
+    rolls_total++;
+}
+
+static bool read_trace(const char *path) {
+    input_event event;
+
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    // Every trace starts with nothing held.
+    memset(presses, 0, sizeof(presses));
+    has_last_down = false;
+
+    while (fread(&event, sizeof(event), 1, fp) == 1) {
+        if (event.type != EV_KEY || event.code >= KEY_CNT)
+            continue;
+        int64_t now = event.time.tv_sec * US_PER_SECOND + event.time.tv_usec;
+        if (event.value == EVENT_VALUE_KEY_DOWN)
+            key_down(event.code, now);
+        else if (event.value == EVENT_VALUE_KEY_UP)
+            key_up(event.code);
+    }
+
+    bool ok = !ferror(fp);
+    if (!ok)
+        fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+    if (fp != stdin)
+        fclose(fp);
+    return ok;
+}
+
+/* Set the windows of the pairs with enough rolls. Return their number. */
+static int learn_windows(uint32_t min_samples, int percentile) {
+    int learned = 0;
+
+    for (int prev = 0; prev < BIGRAM_KEYS; prev++) {
+        for (int key = 0; key < BIGRAM_KEYS; key++) {
+            const uint32_t *histogram = rolls[prev][key];
+            uint64_t samples          = 0;
+            for (int i = 0; i < BUCKETS; i++)
+                samples += histogram[i];
+            if (samples == 0 || samples < min_samples)
+                continue;
+
+            // The upper edge of the bucket the percentile falls in.
+            uint64_t rank = (samples * percentile + 99) / 100, seen = 0;
+            int bucket    = 0;
+            while ((seen += histogram[bucket]) < rank)
+                bucket++;
+            table.window_msec[prev][key] = (bucket + 1) * BUCKET_MSEC;
+            learned++;
+        }
+    }
+    return learned;
+}
+
+static void print_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [-n SAMPLES] [-p PERCENTILE] OUTPUT TRACE...\n"
+            "Learn the burst typing windows by key pair from the raw event "
+            "TRACEs\n(- for STDIN) and write them to OUTPUT for home-row-fu "
+            "--bigrams.\n\n"
+            "  -n SAMPLES     rolls needed to learn a pair (default: %d)\n"
+            "  -p PERCENTILE  rolls the window covers (default: %d)\n",
+            program, DEFAULT_MIN_SAMPLES, DEFAULT_PERCENTILE);
+}
+
+int main(int argc, char *argv[]) {
+    int min_samples = DEFAULT_MIN_SAMPLES, percentile = DEFAULT_PERCENTILE;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:p:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            min_samples = atoi(optarg);
+            break;
+        case 'p':
+            percentile = atoi(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (argc - optind < 2 || min_samples < 1 || percentile < 1 ||
+        percentile > 100) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = optind + 1; i < argc; i++) {
+        if (!read_trace(argv[i]))
+            return EXIT_FAILURE;
+    }
+    int learned = learn_windows(min_samples, percentile);
+    if (!bigram_table_write(argv[optind], &table))
+        return EXIT_FAILURE;
+
+    printf("Learned %d key pairs from %" PRIu64 " rolls.\n", learned,
+           rolls_total);
+    return EXIT_SUCCESS;
+}
@@ -25,14 +25,47 @@
 // Author: Andriy B. Kmit' <dev@madand.net>
 // URL: https://github.com/madand/interception-home-row-fu
 
+#define _GNU_SOURCE  // CPU_SET, sched_setaffinity, accept4, pipe2
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>  // PRIu64
+#include <limits.h>    // PATH_MAX
+#include <malloc.h>    // mallinfo2
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
-#include <stdio.h>   // setbuf, fwrite, fread
+#include <stdio.h>   // fwrite, fprintf
 #include <stdlib.h>  // EXIT_SUCCESS, EXIT_FAILURE
-#include <libevdev/libevdev.h>
-
+#include <string.h>  // strcmp
+#include <sys/inotify.h>
+#include <sys/mman.h>  // mlockall
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>  // chmod
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>      // clock_gettime
+#include <unistd.h>    // STDIN_FILENO, STDOUT_FILENO
+#ifndef STATIC_CONFIG
 #include "lib/toml.h"
+#endif
 #include "home-row-fu.h"
+#include "bigrams.h"
+#include "config-image.h"
+#include "config-toml.h"
+#include "hands.h"
+#include "io-uring.h"
+
+#ifdef STATIC_CONFIG
+// Tables generated by --generate-header, see `make static`.
+#include STATIC_CONFIG
+#endif
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -55,11 +88,408 @@ size_t ev_queue_default_size = 0;
 static input_event ev_queue_delayed[EVENT_BUFFER_SIZE];
 size_t ev_queue_delayed_size = 0;
 
-static int64_t burst_typing_msec      = DEFAULT_BURST_TYPING_MSEC,
-               can_insert_letter_msec = DEFAULT_CAN_INSERT_LETTER_MSEC;
+/* Current configuration. Replaced as a whole on reload. */
+static struct config config = {
+    .settings =
+        {
+            .burst_typing_msec        = DEFAULT_BURST_TYPING_MSEC,
+            .can_insert_letter_msec   = DEFAULT_CAN_INSERT_LETTER_MSEC,
+            .adaptive_burst_min_msec  = DEFAULT_ADAPTIVE_BURST_MIN_MSEC,
+            .adaptive_burst_max_msec  = DEFAULT_ADAPTIVE_BURST_MAX_MSEC,
+            .require_prior_idle_msec  = DEFAULT_REQUIRE_PRIOR_IDLE_MSEC,
+            .key_repeat_delay_msec    = DEFAULT_KEY_REPEAT_DELAY_MSEC,
+            .key_repeat_interval_msec = DEFAULT_KEY_REPEAT_INTERVAL_MSEC,
+            .adaptive_burst_typing    = DEFAULT_ADAPTIVE_BURST_TYPING,
+        },
+    .mappings      = NULL,
+    .mappings_size = 0,
+};
+
+/* What the key handlers read the configuration from. In the static build these
+ * are the generated constant tables, so the compiler can unroll the mapping
+ * loop and fold the thresholds and the events in. */
+#ifdef STATIC_CONFIG
+#define CONFIG_SETTINGS static_config_settings
+#define CONFIG_KEY_MAPPINGS static_key_mappings
+#define CONFIG_KEY_INDEX static_key_index
+#define CONFIG_MAPPINGS_SIZE STATIC_CONFIG_MAPPINGS_SIZE
+#else
+#define CONFIG_SETTINGS config.settings
+#define CONFIG_KEY_MAPPINGS config.key_mappings
+#define CONFIG_KEY_INDEX config.key_index
+#define CONFIG_MAPPINGS_SIZE config.mappings_size
+#endif
+
+/* Burst typing window learned from the typing cadence, see
+ * learn_burst_interval(). */
+static struct {
+    /* Time of the most recent Key Down event, and whether it was of a mapped
+     * key. */
+    struct timeval recent_down_time;
+    bool has_recent_down;
+    bool is_recent_down_mapped;
+    /* Moving averages of the interval between two Key Downs in a typing
+     * streak and of its deviation, in microseconds. 0 until learned. */
+    int64_t interval_usec;
+    int64_t deviation_usec;
+    /* Number of intervals learned since the start. */
+    uint64_t intervals;
+    /* Learned window and the scale of the burst typing thresholds it gives,
+     * relative to the global burst_typing_msec, in 1 / 2^BURST_SCALE_SHIFT. */
+    int64_t window_usec;
+    int64_t scale;
+} burst = {.scale = 1 << BURST_SCALE_SHIFT};
+
+/* Time and key of the most recent Key Down of any key, see is_typing_streak()
+ * and bigram_burst_typing_usec(). */
+static struct timeval recent_key_down_time;
+static uint16_t recent_key_down_code;
+static bool has_recent_key_down = false;
+
+/* Time of the most recent Key Down of a key neither handled nor BackSpace, see
+ * match_backspace(). */
+static struct timeval recent_unmapped_down_time;
+
+/* Time of the most recent pointer event (motion, scroll) while a handled key
+ * was held, see can_start_repeat(). */
+static struct timeval recent_pointer_time;
+
+/* Burst typing windows by key pair, loaded with --bigrams. */
+static struct bigram_table bigrams;
+static bool has_bigrams = false;
+
+/* File the learned burst typing cadence is kept in between runs, or NULL. */
+static const char *burst_state_file = NULL;
+
+/* Input events read ahead by the I/O backend. */
+static input_event input_batch[INPUT_BATCH_SIZE];
+static size_t input_batch_pos = 0, input_batch_len = 0;
+
+/* Events held back while a held key decides between its letter and its
+ * modifier, see defer_event(). All of them, in the order read, so the frames
+ * come out as they came in. */
+static struct {
+    /* The key deciding, NULL if none. */
+    key_state *state;
+    input_event events[DEFERRED_EVENTS_SIZE];
+    size_t size;
+} deferred = {.state = NULL, .size = 0};
+
+/* Held back events to be processed once the key has decided, before any new
+ * input. The pass-through fast path writes from the input batch, so it must
+ * not be taken for them: is_event_replayed tells the event read last came from
+ * here. */
+static input_event replay_queue[DEFERRED_EVENTS_SIZE];
+static size_t replay_pos = 0, replay_len = 0;
+static bool is_event_replayed = false;
+
+/* Runtime statistics, printed to STDERR on exit if requested. */
+static bool stats_enabled = false;
+static struct {
+    /* Number of Key Down events received. */
+    uint64_t keystrokes;
+    /* Events forwarded by the pass-through fast path, and the number of
+     * writes it took. */
+    uint64_t pass_through_events, pass_through_writes;
+    /* Histogram of the delay between the kernel timestamp of a key event and
+     * the moment we start processing it, in microseconds. The last bucket
+     * collects everything longer. */
+    uint32_t latency_usec[LATENCY_HISTOGRAM_SIZE];
+    int64_t latency_usec_max;
+    /* Time it took to load the initial configuration. */
+    int64_t config_load_usec;
+    /* Mapped keys sent as letters right away in a typing streak. */
+    uint64_t streak_letters;
+    /* Modifier Down and Up events not sent, as the modifier was held by
+     * another key already or still. */
+    uint64_t modifier_events_saved;
+} stats;
+
+////////////////////////////////////////////////////////////////////////////////
+/// I/O backends
+
+/* The way events are read from STDIN and written to STDOUT. */
+struct io_backend {
+    const char *name;
+    /* Read at least one and up to max events into buf. Return the number of
+     * events read, or 0 on EOF. */
+    size_t (*read_events)(input_event *buf, size_t max);
+    /* Queue events for output. Exit the program on failure. */
+    void (*write_events)(const input_event *events, size_t count);
+    /* Make sure the queued events are on their way downstream. */
+    void (*flush)(void);
+    /* Write out everything still pending. Called once before exit. */
+    void (*finish)(void);
+    /* Number of I/O syscalls made so far. */
+    uint64_t (*syscall_count)(void);
+};
+
+/* Number of read(2)/write(2) calls made by the stdio backend. */
+static uint64_t stdio_syscalls = 0;
+static bool stdio_has_unflushed = false;
+
+/* Partial event left over from the previous read(2). */
+static input_event stdio_partial_event;
+static size_t stdio_partial_size = 0;
+
+static size_t stdio_read_events(input_event *buf, size_t max) {
+    char *dst   = (char *)buf;
+    size_t have = stdio_partial_size;
+
+    // Take whatever is available, so runs of events can be batched.
+    memcpy(dst, &stdio_partial_event, have);
+    while (have < sizeof(input_event)) {
+        ssize_t n = read(STDIN_FILENO, dst + have,
+                         max * sizeof(input_event) - have);
+        stdio_syscalls++;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        have += n;
+    }
+
+    size_t count       = have / sizeof(input_event);
+    stdio_partial_size = have % sizeof(input_event);
+    memcpy(&stdio_partial_event, dst + count * sizeof(input_event),
+           stdio_partial_size);
+
+    return count;
+}
+
+static void stdio_write_events(const input_event *events, size_t count) {
+    if (fwrite(events, sizeof(input_event), count, stdout) != count) {
+        fprintf(stderr, "Error in stdio_write_events\n");
+        exit(EXIT_FAILURE);
+    }
+    stdio_has_unflushed |= count > 0;
+}
+
+static void stdio_flush(void) {
+    fflush(stdout);
+    stdio_syscalls += stdio_has_unflushed;
+    stdio_has_unflushed = false;
+}
+
+static uint64_t stdio_syscall_count(void) {
+    return stdio_syscalls;
+}
 
-static key_state *mappings;
-static int mappings_size = 0;
+static const struct io_backend io_backend_stdio = {
+    .name          = "stdio",
+    .read_events   = stdio_read_events,
+    .write_events  = stdio_write_events,
+    .flush         = stdio_flush,
+    .finish        = stdio_flush,
+    .syscall_count = stdio_syscall_count,
+};
+
+static void uring_flush(void) {
+    // Output is submitted together with the next read.
+}
+
+static const struct io_backend io_backend_uring = {
+    .name          = "uring",
+    .read_events   = uring_read_events,
+    .write_events  = uring_write_events,
+    .flush         = uring_flush,
+    .finish        = uring_drain,
+    .syscall_count = uring_syscall_count,
+};
+
+static const struct io_backend *io = &io_backend_stdio;
+
+/* Select the I/O backend by name. Fall back to stdio if io_uring is not
+ * available. */
+static void select_io_backend(const char *name) {
+    if (strcmp(name, io_backend_stdio.name) == 0) {
+        io = &io_backend_stdio;
+        return;
+    }
+
+    if (strcmp(name, io_backend_uring.name) == 0) {
+        if (uring_init(STDIN_FILENO, STDOUT_FILENO)) {
+            io = &io_backend_uring;
+        } else {
+            fprintf(stderr,
+                    "Warning: io_uring is not available, falling back to "
+                    "stdio.\n");
+            io = &io_backend_stdio;
+        }
+        return;
+    }
+
+    fprintf(stderr, "Error: unknown I/O backend %s\n", name);
+    exit(EXIT_FAILURE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Threaded output
+
+/* In threaded mode the main thread reads and decides, and a writer thread
+ * writes the output. They are joined by a bounded lock-free single-producer
+ * single-consumer ring, so a stalled consumer of STDOUT does not hold up
+ * the reading and timing of new events. */
+
+/* Backend the main thread keeps reading from. */
+static const struct io_backend *threaded_reader;
+
+static input_event output_ring[OUTPUT_RING_SIZE];
+/* Only written by the main thread. */
+static size_t output_ring_head = 0;
+/* Only written by the writer thread. */
+static size_t output_ring_tail = 0;
+/* Set by the main thread once it has pushed its last event. */
+static bool output_ring_closed = false;
+/* Posted by the main thread after pushing a batch of events. */
+static sem_t output_ring_ready;
+
+static pthread_t writer_thread;
+
+/* Updated by the main thread. */
+static size_t output_ring_max_depth = 0;
+static uint64_t output_ring_full_waits = 0;
+
+/* Updated by the writer thread, read after it has been joined. */
+static uint64_t writer_syscalls = 0, writer_stalls = 0;
+static int64_t writer_stall_usec_total = 0, writer_stall_usec_max = 0;
+
+static inline int64_t monotonic_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * US_PER_SECOND + ts.tv_nsec / 1000;
+}
+
+/* Write the whole buffer to STDOUT, accounting for stalls. */
+static void writer_write_all(const input_event *events, size_t count) {
+    const char *buf = (const char *)events;
+    size_t len      = count * sizeof(input_event);
+
+    while (len > 0) {
+        int64_t start = monotonic_usec();
+        ssize_t n     = write(STDOUT_FILENO, buf, len);
+        int64_t took  = monotonic_usec() - start;
+        writer_syscalls++;
+
+        if (took >= WRITER_STALL_USEC) {
+            writer_stalls++;
+            writer_stall_usec_total += took;
+            if (took > writer_stall_usec_max)
+                writer_stall_usec_max = took;
+        }
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error in writer_write_all\n");
+            exit(EXIT_FAILURE);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void *writer_thread_main(void *arg) {
+    (void)arg;
+    size_t tail = output_ring_tail;
+
+    for (;;) {
+        size_t head = __atomic_load_n(&output_ring_head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (__atomic_load_n(&output_ring_closed, __ATOMIC_ACQUIRE)) {
+                // The last push happened before closing, so this is final.
+                if (__atomic_load_n(&output_ring_head, __ATOMIC_ACQUIRE) ==
+                    tail)
+                    return NULL;
+                continue;
+            }
+            while (sem_wait(&output_ring_ready) == -1 && errno == EINTR)
+                ;
+            continue;
+        }
+
+        // Write straight from the ring, up to the wrap-around point.
+        size_t start = tail & (OUTPUT_RING_SIZE - 1);
+        size_t count = head - tail;
+        if (count > OUTPUT_RING_SIZE - start)
+            count = OUTPUT_RING_SIZE - start;
+        writer_write_all(output_ring + start, count);
+
+        tail += count;
+        __atomic_store_n(&output_ring_tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+static size_t threaded_read_events(input_event *buf, size_t max) {
+    return threaded_reader->read_events(buf, max);
+}
+
+static void threaded_write_events(const input_event *events, size_t count) {
+    size_t head = output_ring_head;
+
+    while (count > 0) {
+        size_t tail  = __atomic_load_n(&output_ring_tail, __ATOMIC_ACQUIRE);
+        size_t space = OUTPUT_RING_SIZE - (head - tail);
+        if (space == 0) {
+            // The writer is stalled and the ring is full. Let it catch up.
+            output_ring_full_waits++;
+            __atomic_store_n(&output_ring_head, head, __ATOMIC_RELEASE);
+            sem_post(&output_ring_ready);
+            while (__atomic_load_n(&output_ring_tail, __ATOMIC_ACQUIRE) ==
+                   tail)
+                usleep(OUTPUT_RING_FULL_SLEEP_USEC);
+            continue;
+        }
+
+        size_t n = count < space ? count : space;
+        for (size_t i = 0; i < n; i++)
+            output_ring[(head + i) & (OUTPUT_RING_SIZE - 1)] = events[i];
+        head += n;
+        events += n;
+        count -= n;
+
+        if (head - tail > output_ring_max_depth)
+            output_ring_max_depth = head - tail;
+    }
+
+    __atomic_store_n(&output_ring_head, head, __ATOMIC_RELEASE);
+}
+
+static void threaded_flush(void) {
+    sem_post(&output_ring_ready);
+}
+
+static void threaded_finish(void) {
+    __atomic_store_n(&output_ring_closed, true, __ATOMIC_RELEASE);
+    sem_post(&output_ring_ready);
+    pthread_join(writer_thread, NULL);
+}
+
+static uint64_t threaded_syscall_count(void) {
+    return threaded_reader->syscall_count() + writer_syscalls;
+}
+
+static const struct io_backend io_backend_threaded = {
+    .name          = "threaded",
+    .read_events   = threaded_read_events,
+    .write_events  = threaded_write_events,
+    .flush         = threaded_flush,
+    .finish        = threaded_finish,
+    .syscall_count = threaded_syscall_count,
+};
+
+/* Move the writing of the current backend to a separate thread. */
+static void start_writer_thread(void) {
+    threaded_reader = io;
+
+    if (sem_init(&output_ring_ready, 0, 0) == -1 ||
+        pthread_create(&writer_thread, NULL, writer_thread_main, NULL) != 0) {
+        fprintf(stderr, "Failed to start the writer thread!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    io = &io_backend_threaded;
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 /// Helper functions
@@ -107,35 +537,37 @@ static inline void enqueue_delayed_event_and_syn(const input_event *event) {
 /* Write all events to STDOUT. First the events form the default queue and then
  * from the delayed one. Then set the index variables of both queues to 0. */
 static inline void flush_events() {
-    if (fwrite(ev_queue_default, sizeof(input_event), ev_queue_default_size,
-               stdout) != ev_queue_default_size) {
-        fprintf(stderr, "Error in flush_events ev_queue_default\n");
-        exit(EXIT_FAILURE);
-    }
-
-    if (fwrite(ev_queue_delayed, sizeof(input_event), ev_queue_delayed_size,
-               stdout) != ev_queue_delayed_size) {
-        fprintf(stderr, "Error in flush_events ev_queue_delayed\n");
-        exit(EXIT_FAILURE);
-    }
-
-    fflush(stdout);
+    io->write_events(ev_queue_default, ev_queue_default_size);
+    io->write_events(ev_queue_delayed, ev_queue_delayed_size);
+    io->flush();
 
     ev_queue_default_size = ev_queue_delayed_size = 0;
 }
 
-/* Read next event from STDIN. Return true on success. */
+/* Read next event, from the replay queue or else from STDIN. Return true on
+ * success. */
 static inline bool read_event(input_event *event) {
-    return fread(event, sizeof(input_event), 1, stdin) == 1;
+    is_event_replayed = replay_pos < replay_len;
+    if (is_event_replayed) {
+        *event = replay_queue[replay_pos++];
+        return true;
+    }
+
+    if (input_batch_pos == input_batch_len) {
+        input_batch_pos = 0;
+        input_batch_len = io->read_events(input_batch, INPUT_BATCH_SIZE);
+        if (input_batch_len == 0)
+            return false;
+    }
+
+    *event = input_batch[input_batch_pos++];
+    return true;
 }
 
 /* Write event to STDOUT. If write failed, exit the program. */
 static inline void write_event(const input_event *event) {
-    if (fwrite(event, sizeof(input_event), 1, stdout) != 1) {
-        fprintf(stderr, "Error in write_event\n");
-        exit(EXIT_FAILURE);
-    }
-    fflush(stdout);
+    io->write_events(event, 1);
+    io->flush();
 }
 
 /* Return the difference in microseconds between the given timevals. */
@@ -155,32 +587,468 @@ static inline bool is_event_for_key(const input_event *event,
     return event->code == key_code;
 }
 
+/* Return the burst typing threshold of the key press: the one of its bigram if
+ * learned, else the one of the key, following the learned window in adaptive
+ * mode. */
+static inline int64_t burst_typing_usec(const key_state *state,
+                                        const key_mapping *mapping) {
+    if (state->bigram_window_usec > 0)
+        return state->bigram_window_usec;
+    if (!CONFIG_SETTINGS.adaptive_burst_typing)
+        return mapping->burst_typing_usec;
+    return (mapping->burst_typing_usec * burst.scale) >> BURST_SCALE_SHIFT;
+}
+
 /* Delay-based guard to protect the key from becoming a modifier too early.
  * This delay is crucial if you type fast enough. */
-static inline bool can_lock_to_modifier(
-    const struct timeval *recent_down_time) {
-    return time_diff(recent_down_time, &recent_scan.time) >
-           (burst_typing_msec * US_PER_MS);
+static inline bool can_lock_to_modifier(const key_state *state,
+                                        const key_mapping *mapping) {
+    return time_diff(&state->recent_down_time, &recent_scan.time) >
+           burst_typing_usec(state, mapping);
 }
 
 /* Guard against the insertion of a letter, if the key was pressed for a longish
  * time. */
-static inline bool can_send_real_down(const struct timeval *recent_down_time) {
-    return time_diff(recent_down_time, &recent_scan.time) <
-           (can_insert_letter_msec * US_PER_MS);
+static inline bool can_send_real_down(const key_state *state,
+                                      const key_mapping *mapping) {
+    return time_diff(&state->recent_down_time, &recent_scan.time) <
+           mapping->can_insert_letter_usec;
+}
+
+/* Return the burst typing window of the bigram the key goes down in, i.e. the
+ * key pressed right before it and the key itself, or 0 if there is none. */
+static inline int64_t bigram_burst_typing_usec(const key_mapping *mapping,
+                                               const input_event *event) {
+    if (!has_bigrams || !has_recent_key_down ||
+        time_diff(&recent_key_down_time, &event->time) >
+            BURST_STREAK_GAP_MSEC * US_PER_MS)
+        return 0;
+    return (int64_t)bigrams.window_msec[bigram_key(recent_key_down_code)]
+                                       [bigram_key(mapping->key)] *
+           US_PER_MS;
+}
+
+/* Return true if the key goes down in a typing streak: sooner than
+ * require_prior_idle_msec after the previous Key Down of any key. A mapped key
+ * is almost certainly a letter then. */
+static inline bool is_typing_streak(const input_event *event) {
+    const int64_t idle_usec =
+        CONFIG_SETTINGS.require_prior_idle_msec * US_PER_MS;
+    return idle_usec > 0 && has_recent_key_down &&
+           time_diff(&recent_key_down_time, &event->time) < idle_usec;
+}
+
+/* Return true if the key is held, but is neither a modifier nor a letter
+ * yet. */
+static inline bool is_undecided(const key_state *state) {
+    return state->is_held && !state->is_locked_to_modifier &&
+           !state->has_sent_real_down;
+}
+
+/* Return true if a Key Down of the given key is held back. */
+static inline bool is_key_down_deferred(uint16_t key_code) {
+    for (size_t i = 0; i < deferred.size; i++) {
+        if (deferred.events[i].type == EV_KEY &&
+            deferred.events[i].code == key_code &&
+            deferred.events[i].value == EVENT_VALUE_KEY_DOWN)
+            return true;
+    }
+    return false;
+}
+
+/* Return true if the event is forwarded unchanged, i.e. it is neither a key
+ * event nor the scan event preceding one. */
+static inline bool is_pass_through_event(const input_event *event) {
+    return event->type != EV_KEY &&
+           !(event->type == EV_MSC && event->code == MSC_SCAN);
+}
+
+/* Return true if none of the handled keys is currently held. */
+static inline bool are_mappings_idle(void) {
+    for (int i = 0; i < CONFIG_MAPPINGS_SIZE; i++) {
+        if (config.mappings[i].is_held)
+            return false;
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Hold/tap policies
+
+/* What a held key, which is neither a modifier nor a letter yet, turns into. */
+enum hold_tap_decision {
+    DECISION_UNDECIDED,
+    /* The modifier, until the key is released. */
+    DECISION_HOLD,
+    /* The letter. */
+    DECISION_TAP,
+    /* Hold the key events back until decided. */
+    DECISION_DEFER,
+};
+
+/* A policy of deciding between the letter and the modifier of a held key. */
+struct hold_tap_policy_ops {
+    /* Another key goes down while the key is held and undecided. */
+    enum hold_tap_decision (*other_key_down)(const key_state *state,
+                                             const key_mapping *mapping);
+    /* A key event comes while the events are held back for the key, including
+     * its own Key Up. NULL if the policy never defers. */
+    enum hold_tap_decision (*deferred_event)(const key_state *state,
+                                             const key_mapping *mapping,
+                                             const input_event *event);
+};
+
+/* The modifier if the key has been held longer than the burst typing window,
+ * the letter if not longer than can_insert_letter_msec. Decides right away,
+ * with the time as the only signal. */
+static enum hold_tap_decision timer_other_key_down(const key_state *state,
+                                                   const key_mapping *mapping) {
+    if (can_lock_to_modifier(state, mapping))
+        return DECISION_HOLD;
+    if (can_send_real_down(state, mapping))
+        return DECISION_TAP;
+    return DECISION_UNDECIDED;
+}
+
+/* The modifier as soon as another key goes down. No lag, but rolls over the
+ * key turn into chords. */
+static enum hold_tap_decision hold_on_other_key_press_other_key_down(
+    const key_state *state, const key_mapping *mapping) {
+    (void)state;
+    (void)mapping;
+    return DECISION_HOLD;
+}
+
+/* Past the burst typing window the modifier, as with the timer. Within it, the
+ * other key is held back until either of the keys is released. */
+static enum hold_tap_decision permissive_hold_other_key_down(
+    const key_state *state, const key_mapping *mapping) {
+    return can_lock_to_modifier(state, mapping) ? DECISION_HOLD
+                                                : DECISION_DEFER;
+}
+
+/* The modifier if another key is pressed and released while the key is held,
+ * the letter if the key is released first (a roll). */
+static enum hold_tap_decision permissive_hold_deferred_event(
+    const key_state *state, const key_mapping *mapping,
+    const input_event *event) {
+    if (event->value != EVENT_VALUE_KEY_UP)
+        return DECISION_UNDECIDED;
+    if (is_event_for_key(event, mapping->key))
+        return can_send_real_down(state, mapping) ? DECISION_TAP
+                                                  : DECISION_HOLD;
+    return is_key_down_deferred(event->code) ? DECISION_HOLD
+                                             : DECISION_UNDECIDED;
+}
+
+/* As permissive-hold, but also the modifier once the key has been held longer
+ * than the burst typing window, even if no key has been released yet. */
+static enum hold_tap_decision balanced_deferred_event(
+    const key_state *state, const key_mapping *mapping,
+    const input_event *event) {
+    if (can_lock_to_modifier(state, mapping))
+        return DECISION_HOLD;
+    return permissive_hold_deferred_event(state, mapping, event);
+}
+
+/* The policies by enum hold_tap_policy. */
+static const struct hold_tap_policy_ops
+    hold_tap_policies[HOLD_TAP_POLICY_CNT] = {
+        [HOLD_TAP_TIMER] = {timer_other_key_down, NULL},
+        [HOLD_TAP_HOLD_ON_OTHER_KEY_PRESS] =
+            {hold_on_other_key_press_other_key_down, NULL},
+        [HOLD_TAP_PERMISSIVE_HOLD] = {permissive_hold_other_key_down,
+                                      permissive_hold_deferred_event},
+        [HOLD_TAP_BALANCED] = {permissive_hold_other_key_down,
+                               balanced_deferred_event},
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// Bilateral combinations
+
+/* Return the hand of the key: the one of its mapping if it sets one, else the
+ * one of its position. HAND_NONE for the keys of both hands, as the space
+ * bar. */
+static inline uint8_t key_hand(uint16_t key_code) {
+    if (key_code >= KEY_CNT)
+        return HAND_NONE;
+
+    uint16_t index = CONFIG_KEY_INDEX[key_code];
+    if (index != 0 && CONFIG_KEY_MAPPINGS[index - 1].hand != HAND_NONE)
+        return CONFIG_KEY_MAPPINGS[index - 1].hand;
+    return key_hands[key_code];
+}
+
+/* Return true if the other key is typed with the same hand as the held one,
+ * which makes it a roll rather than a combination. */
+static inline bool is_same_hand_roll(const key_mapping *mapping,
+                                     const input_event *event) {
+    uint8_t hand = key_hand(mapping->key);
+    return hand != HAND_NONE && hand == key_hand(event->code);
+}
+
+/* Decide about the held and undecided key as another key goes down. With
+ * bilateral combinations a key of the same hand makes it the letter, as long as
+ * the letter can be inserted; otherwise the policy of the key decides. */
+static inline enum hold_tap_decision decide_other_key_down(
+    const input_event *event, const key_state *state,
+    const key_mapping *mapping) {
+    if (mapping->bilateral_combinations && is_same_hand_roll(mapping, event) &&
+        can_send_real_down(state, mapping))
+        return DECISION_TAP;
+    return hold_tap_policies[mapping->hold_tap_policy].other_key_down(state,
+                                                                      mapping);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Pass-through fast path
+
+/* Forward the most recently read event together with all pass-through events
+ * following it in the input batch. They are written in place from the batch
+ * with a single write, which matters for the EV_REL/EV_ABS floods of
+ * keyboards with a built-in pointing device. */
+static inline void write_pass_through_run(void) {
+    size_t start = input_batch_pos - 1, end = input_batch_pos;
+    while (end < input_batch_len && is_pass_through_event(&input_batch[end]))
+        end++;
+
+    io->write_events(&input_batch[start], end - start);
+    io->flush();
+
+    stats.pass_through_events += end - start;
+    stats.pass_through_writes++;
+    input_batch_pos = end;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Modifier holds
+
+/* A modifier may be held by its real key and by any number of keys emulating
+ * it at once. Downstream it must go down with the first of them and up with the
+ * last one, or it gets pressed twice and released early. The real keys are
+ * tracked in a bitmask and the emulating keys counted, for the modifier keys
+ * only: other modifier_key codes are sent as they come. */
+
+/* Real modifier keys held, by bit of modifier_key_index(). */
+static uint8_t physical_modifiers = 0;
+/* Number of keys emulating each modifier at the moment. */
+static uint8_t emulated_modifiers[MODIFIER_KEYS_CNT];
+
+/* Return the index of the modifier key, or -1 if the key is not one. */
+static inline int modifier_key_index(uint16_t key_code) {
+    switch (key_code) {
+    case KEY_LEFTCTRL:
+        return 0;
+    case KEY_LEFTSHIFT:
+        return 1;
+    case KEY_LEFTALT:
+        return 2;
+    case KEY_LEFTMETA:
+        return 3;
+    case KEY_RIGHTCTRL:
+        return 4;
+    case KEY_RIGHTSHIFT:
+        return 5;
+    case KEY_RIGHTALT:
+        return 6;
+    case KEY_RIGHTMETA:
+        return 7;
+    default:
+        return -1;
+    }
+}
+
+/* Count the key holding its modifier. Return true if the modifier Down is to be
+ * sent, i.e. nothing held the modifier yet. */
+static inline bool hold_modifier(const key_mapping *mapping) {
+    int index = modifier_key_index(mapping->ev_modifier_down.code);
+    if (index < 0)
+        return true;
+    if (emulated_modifiers[index]++ == 0 &&
+        !(physical_modifiers & 1 << index))
+        return true;
+    stats.modifier_events_saved++;
+    return false;
+}
+
+/* Count the key letting go of its modifier. Return true if the modifier Up is
+ * to be sent, i.e. nothing else holds the modifier. */
+static inline bool release_modifier(const key_mapping *mapping) {
+    int index = modifier_key_index(mapping->ev_modifier_up.code);
+    if (index < 0)
+        return true;
+    // An unmatched release must not wrap the count around.
+    if (emulated_modifiers[index] == 0)
+        return true;
+    if (--emulated_modifiers[index] == 0 &&
+        !(physical_modifiers & 1 << index))
+        return true;
+    stats.modifier_events_saved++;
+    return false;
+}
+
+/* Note the event of an unhandled key, in case it is a real modifier. Return
+ * false if it is not to be sent, as keys emulating the modifier hold it: it is
+ * down already, and stays down until they let go. */
+static inline bool track_physical_modifier(const input_event *event) {
+    int index = modifier_key_index(event->code);
+    if (index < 0)
+        return true;
+
+    if (event->value == EVENT_VALUE_KEY_DOWN)
+        physical_modifiers |= 1 << index;
+    else if (event->value == EVENT_VALUE_KEY_UP)
+        physical_modifiers &= ~(1 << index);
+    if (emulated_modifiers[index] == 0)
+        return true;
+    stats.modifier_events_saved++;
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Misfire estimator
+
+/* Every decision of a handled key is kept for a while, to be matched against a
+ * correction following it: a BackSpace, or the key pressed again and made a
+ * modifier right after it typed its letter. Either strongly hints that the
+ * decision was wrong. */
+
+/* Return true if a correction at the given time can be about the decision. */
+static inline bool is_decision_recent(const struct decision_record *record,
+                                      const struct timeval *now) {
+    int64_t age = time_diff(&record->time, now);
+    return age >= 0 && age <= MISFIRE_WINDOW_MSEC * US_PER_MS;
+}
+
+static inline void mark_misfire(struct misfire_stats *misfires,
+                                struct decision_record *record) {
+    record->is_misfire = true;
+    misfires->misfires[record->branch]++;
+}
+
+/* Note the decision of the key, made by the current event. */
+static inline void record_decision(key_state *state,
+                                   enum decision_branch branch) {
+    struct misfire_stats *misfires = &state->misfires;
+
+    // A modifier right after the letter: the user is trying again.
+    if (branch == BRANCH_MODIFIER_ON_OTHER_KEY) {
+        for (int i = 1; i <= MISFIRE_RING_SIZE; i++) {
+            struct decision_record *record =
+                &misfires->recent[(misfires->recent_pos + MISFIRE_RING_SIZE -
+                                   i) %
+                                  MISFIRE_RING_SIZE];
+            if (record->branch != BRANCH_MODIFIER_ON_OTHER_KEY &&
+                !record->is_misfire &&
+                is_decision_recent(record, &recent_scan.time)) {
+                mark_misfire(misfires, record);
+                break;
+            }
+        }
+    }
+
+    misfires->recent[misfires->recent_pos] = (struct decision_record){
+        .time = recent_scan.time, .branch = branch, .is_misfire = false};
+    misfires->recent_pos = (misfires->recent_pos + 1) % MISFIRE_RING_SIZE;
+    misfires->decisions[branch]++;
+}
+
+/* Blame the BackSpace on the latest recent decision which typed something
+ * after the last press of an unhandled key, as that is what it takes back. */
+static void match_backspace(const input_event *event) {
+    struct decision_record *latest = NULL;
+    struct misfire_stats *latest_misfires;
+
+    for (int i = 0; i < CONFIG_MAPPINGS_SIZE; i++) {
+        struct misfire_stats *misfires = &config.mappings[i].misfires;
+        for (int j = 0; j < MISFIRE_RING_SIZE; j++) {
+            struct decision_record *record = &misfires->recent[j];
+            if (record->is_misfire || !is_decision_recent(record, &event->time))
+                continue;
+
+            // The letter decided by the press of an unhandled key comes before
+            // the letter of that key.
+            int64_t since =
+                time_diff(&recent_unmapped_down_time, &record->time);
+            if (since < 0 ||
+                (since == 0 && record->branch == BRANCH_LETTER_ON_OTHER_KEY))
+                continue;
+            if (latest == NULL || time_diff(&latest->time, &record->time) > 0) {
+                latest          = record;
+                latest_misfires = misfires;
+            }
+        }
+    }
+    if (latest != NULL)
+        mark_misfire(latest_misfires, latest);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 /// Key handlers
 
-static inline void handle_key_down(const input_event *event, key_state *state) {
-    if (is_event_for_key(event, state->key)) {
-        if (state->immediately_send_modifier) {
-            enqueue_delayed_event_and_syn(&state->ev_modifier_down);
+/* Take back the letter the key typed speculatively. */
+static inline void correct_speculative_letter(key_state *state,
+                                              const key_mapping *mapping) {
+    enqueue_event_and_syn(&mapping->ev_correction_down);
+    enqueue_event_and_syn(&mapping->ev_correction_up);
+    state->has_sent_speculative_letter = false;
+    state->corrections++;
+}
+
+/* Turn the held key into its modifier or its letter, as decided. */
+static inline void decide_hold_tap(key_state *state, const key_mapping *mapping,
+                                   enum hold_tap_decision decision) {
+    if (decision == DECISION_HOLD) {
+        if (state->has_sent_speculative_letter)
+            correct_speculative_letter(state, mapping);
+        if (!state->is_modifier_held) {
+            if (hold_modifier(mapping))
+                enqueue_event_and_syn(&mapping->ev_modifier_down);
             state->is_modifier_held = true;
         }
-        state->recent_down_time = event->time;
-        state->is_held          = true;
+        state->is_locked_to_modifier = true;
+        record_decision(state, BRANCH_MODIFIER_ON_OTHER_KEY);
+    } else if (decision == DECISION_TAP) {
+        if (state->is_modifier_held) {
+            if (release_modifier(mapping))
+                enqueue_event_and_syn(&mapping->ev_modifier_up);
+            state->is_modifier_held = false;
+        }
+        // A speculative letter has been typed already, Up included.
+        if (!state->has_sent_speculative_letter)
+            enqueue_event_and_syn(&mapping->ev_real_down);
+        state->has_sent_real_down = true;
+        record_decision(state, BRANCH_LETTER_ON_OTHER_KEY);
+    }
+}
+
+static inline void handle_key_down(const input_event *event, key_state *state,
+                                   const key_mapping *mapping) {
+    if (is_event_for_key(event, mapping->key)) {
+        state->recent_down_time   = event->time;
+        state->is_held            = true;
+        state->bigram_window_usec = bigram_burst_typing_usec(mapping, event);
+        if (is_typing_streak(event)) {
+            // Delayed, so that it comes after the letters and modifiers this
+            // Key Down decides for the other held keys.
+            enqueue_delayed_event_and_syn(&mapping->ev_real_down);
+            state->has_sent_real_down = true;
+            stats.streak_letters++;
+            record_decision(state, BRANCH_LETTER_IN_STREAK);
+            return;
+        }
+        if (mapping->immediately_send_modifier) {
+            if (hold_modifier(mapping))
+                enqueue_delayed_event_and_syn(&mapping->ev_modifier_down);
+            state->is_modifier_held = true;
+        } else if (mapping->speculative_letters) {
+            // Delayed as well, and typed in full: a letter held down would
+            // start repeating before the key decides.
+            enqueue_delayed_event_and_syn(&mapping->ev_real_down);
+            enqueue_delayed_event_and_syn(&mapping->ev_real_up);
+            state->has_sent_speculative_letter = true;
+            state->speculative_letters_sent++;
+        }
         return;
     }
 
@@ -190,281 +1058,1599 @@ static inline void handle_key_down(const input_event *event, key_state *state) {
         if (state->is_locked_to_modifier || state->has_sent_real_down)
             return;
 
-        if (can_lock_to_modifier(&state->recent_down_time)) {
-            if (!state->is_modifier_held) {
-                enqueue_event_and_syn(&state->ev_modifier_down);
-                state->is_modifier_held = true;
-            }
-            state->is_locked_to_modifier = true;
-            return;
-        }
-
-        if (can_send_real_down(&state->recent_down_time)) {
-            if (state->is_modifier_held) {
-                enqueue_event_and_syn(&state->ev_modifier_up);
-                state->is_modifier_held = false;
-            }
-            enqueue_event_and_syn(&state->ev_real_down);
-            state->has_sent_real_down = true;
-            return;
-        }
+        decide_hold_tap(state, mapping,
+                        decide_other_key_down(event, state, mapping));
     }
 }
 
-static inline void handle_key_up(const input_event *event, key_state *state) {
-    if (!is_event_for_key(event, state->key))
+static inline void handle_key_up(const input_event *event, key_state *state,
+                                 const key_mapping *mapping) {
+    if (!is_event_for_key(event, mapping->key))
         return;
 
     state->is_held = false;
 
     if (state->is_locked_to_modifier) {
-        enqueue_event_and_syn(&state->ev_modifier_up);
+        if (state->is_modifier_held && release_modifier(mapping))
+            enqueue_event_and_syn(&mapping->ev_modifier_up);
         state->is_locked_to_modifier = state->is_modifier_held = false;
         return;
     }
 
     if (state->is_modifier_held) {
-        enqueue_event_and_syn(&state->ev_modifier_up);
+        if (release_modifier(mapping))
+            enqueue_event_and_syn(&mapping->ev_modifier_up);
         state->is_modifier_held = false;
     }
 
     if (state->has_sent_real_down) {
-        enqueue_event_and_syn(&state->ev_real_up);
-        state->has_sent_real_down = false;
+        if (!state->has_sent_speculative_letter)
+            enqueue_event_and_syn(&mapping->ev_real_up);
+        state->has_sent_real_down = state->has_sent_speculative_letter = false;
+        state->is_repeating       = false;
         return;
     }
 
-    if (can_send_real_down(&state->recent_down_time)) {
-        enqueue_event_and_syn(&state->ev_real_down);
-        enqueue_event_and_syn(&state->ev_real_up);
+    if (state->has_sent_speculative_letter) {
+        // Held alone for longish, the key types nothing.
+        if (can_send_real_down(state, mapping)) {
+            state->has_sent_speculative_letter = false;
+            record_decision(state, BRANCH_LETTER_ON_RELEASE);
+        } else {
+            correct_speculative_letter(state, mapping);
+        }
+        return;
     }
+
+    if (can_send_real_down(state, mapping)) {
+        enqueue_event_and_syn(&mapping->ev_real_down);
+        enqueue_event_and_syn(&mapping->ev_real_up);
+        record_decision(state, BRANCH_LETTER_ON_RELEASE);
+    }
+}
+
+/* Return true if the key, held alone, is due to start repeating its
+ * letter. Not if it holds its modifier down already, as the immediately sent
+ * ones do, nor if the pointer moved meanwhile: it is held for a Ctrl + Scroll
+ * or a drag then, and a letter would get in the way. Another key pressed
+ * meanwhile has decided the key already. */
+static inline bool can_start_repeat(const input_event *event,
+                                    const key_state *state,
+                                    const key_mapping *mapping) {
+    const int64_t delay_usec =
+        CONFIG_SETTINGS.key_repeat_delay_msec * US_PER_MS;
+    return delay_usec > 0 && !mapping->immediately_send_modifier &&
+           !state->is_modifier_held &&
+           time_diff(&state->recent_down_time, &recent_pointer_time) < 0 &&
+           time_diff(&state->recent_down_time, &event->time) >=
+               mapping->can_insert_letter_usec + delay_usec;
 }
 
-static inline bool handle_key(const input_event *event, key_state *state) {
+/* The autorepeat of the keyboard is the clock of the key repeat: there are
+ * repeat events while the key is held. A key which typed its letter forwards
+ * them. A key held alone past the repeat delay becomes its letter, and types
+ * it again every key_repeat_interval_msec. A modifier never repeats. */
+static inline void handle_key_repeat(const input_event *event,
+                                     key_state *state,
+                                     const key_mapping *mapping) {
+    if (!is_event_for_key(event, mapping->key) || state->is_locked_to_modifier)
+        return;
+
+    if (!state->has_sent_real_down) {
+        if (!can_start_repeat(event, state, mapping))
+            return;
+        // Pressed again, if a speculative letter was typed.
+        enqueue_event_and_syn(&mapping->ev_real_down);
+        state->has_sent_real_down          = true;
+        state->has_sent_speculative_letter = false;
+        state->is_repeating                = true;
+        state->recent_repeat_time          = event->time;
+        return;
+    }
+
+    if (state->is_repeating) {
+        if (time_diff(&state->recent_repeat_time, &event->time) <
+            CONFIG_SETTINGS.key_repeat_interval_msec * US_PER_MS)
+            return;
+        // As a new press rather than a repeat event, which libinput drops.
+        enqueue_event_and_syn(&mapping->ev_real_up);
+        enqueue_event_and_syn(&mapping->ev_real_down);
+        state->recent_repeat_time = event->time;
+        return;
+    }
+
+    if (state->has_sent_speculative_letter) {
+        // The letter is up already: press it again, for the Key Up to release.
+        enqueue_event_and_syn(&mapping->ev_real_down);
+        state->has_sent_speculative_letter = false;
+        return;
+    }
+
+    input_event repeat = mapping->ev_real_down;
+    repeat.value       = EVENT_VALUE_KEY_REPEAT;
+    enqueue_event_and_syn(&repeat);
+}
+
+static inline void handle_key(const input_event *event, key_state *state,
+                              const key_mapping *mapping) {
     if (event->value == EVENT_VALUE_KEY_DOWN) {
-        handle_key_down(event, state);
+        handle_key_down(event, state, mapping);
     } else if (event->value == EVENT_VALUE_KEY_UP) {
-        handle_key_up(event, state);
+        handle_key_up(event, state, mapping);
+    } else if (event->value == EVENT_VALUE_KEY_REPEAT) {
+        handle_key_repeat(event, state, mapping);
     }
-
-    return is_event_for_key(event, state->key);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-/// Configuration handling
+/// Deferred decisions
 
-/* Read an integer value into ret. */
-static void read_config_int(const toml_table_t *table, const char *key,
-                            int64_t *ret) {
-    int64_t maybe_ret;
-    toml_raw_t currval = toml_raw_in(table, key);
-    if (currval != NULL && toml_rtoi(currval, &maybe_ret) != -1) {
-        if (maybe_ret >= 0) {
-            *ret = maybe_ret;
-        } else {
-            fprintf(stderr, "Warning: ignoring negative value (%ld) for %s\n",
-                    maybe_ret, key);
+/* Hold the event back. */
+static inline void push_deferred_event(const input_event *event) {
+    deferred.events[deferred.size++] = *event;
+}
+
+/* Queue the held back events for processing, ahead of what is left of an
+ * earlier replay: they were read before it. */
+static void replay_deferred_events(void) {
+    size_t left = replay_len - replay_pos;
+
+    memmove(replay_queue + deferred.size, replay_queue + replay_pos,
+            left * sizeof(*replay_queue));
+    memcpy(replay_queue, deferred.events,
+           deferred.size * sizeof(*deferred.events));
+    replay_pos     = 0;
+    replay_len     = deferred.size + left;
+    deferred.size  = 0;
+    deferred.state = NULL;
+}
+
+/* Start holding the key events back, if the policy of a held and undecided
+ * key wants to see what follows the Key Down before deciding. Return true if
+ * the event was held back. */
+static inline bool defer_key_down(const input_event *event) {
+    if (event->value != EVENT_VALUE_KEY_DOWN)
+        return false;
+
+    for (int i = 0; i < CONFIG_MAPPINGS_SIZE; i++) {
+        key_state *state           = &config.mappings[i];
+        const key_mapping *mapping = &CONFIG_KEY_MAPPINGS[i];
+
+        if (hold_tap_policies[mapping->hold_tap_policy].deferred_event ==
+                NULL ||
+            !is_undecided(state) || is_event_for_key(event, mapping->key))
+            continue;
+        if (decide_other_key_down(event, state, mapping) == DECISION_DEFER) {
+            // The scan event has been read already.
+            deferred.state = state;
+            push_deferred_event(&recent_scan);
+            push_deferred_event(event);
+            return true;
         }
     }
+    return false;
+}
+
+/* While a key decides, show its policy the key events and hold back all the
+ * events. Once decided, turn the key into its modifier or letter and queue the
+ * held back events, this one included, for processing. */
+static void defer_event(const input_event *event) {
+    key_state *state           = deferred.state;
+    const key_mapping *mapping = state->mapping;
+
+    enum hold_tap_decision decision = DECISION_UNDECIDED;
+    if (event->type == EV_KEY)
+        decision = hold_tap_policies[mapping->hold_tap_policy].deferred_event(
+            state, mapping, event);
+    push_deferred_event(event);
+
+    // The key must decide by its Key Up at the latest, and before the room
+    // runs out.
+    if (decision != DECISION_HOLD && decision != DECISION_TAP &&
+        ((event->type == EV_KEY && is_event_for_key(event, mapping->key)) ||
+         deferred.size == DEFERRED_EVENTS_SIZE))
+        decision = can_lock_to_modifier(state, mapping) ? DECISION_HOLD
+                                                        : DECISION_TAP;
+    if (decision != DECISION_HOLD && decision != DECISION_TAP)
+        return;
+
+    decide_hold_tap(state, mapping, decision);
+    flush_events();
+    replay_deferred_events();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Adaptive burst typing
+
+/* Recompute the learned window from the averages, and the scale of the
+ * thresholds from it. Also needed when the settings change. */
+static void update_burst_window(void) {
+    const struct config_settings *settings = &CONFIG_SETTINGS;
+    const int64_t base_usec = settings->burst_typing_msec * US_PER_MS;
+
+    if (burst.interval_usec == 0 || base_usec == 0) {
+        burst.window_usec = base_usec;
+        burst.scale       = 1 << BURST_SCALE_SHIFT;
+        return;
+    }
+
+    int64_t window =
+        burst.interval_usec + BURST_WINDOW_DEVIATIONS * burst.deviation_usec;
+    if (window < settings->adaptive_burst_min_msec * US_PER_MS)
+        window = settings->adaptive_burst_min_msec * US_PER_MS;
+    if (window > settings->adaptive_burst_max_msec * US_PER_MS)
+        window = settings->adaptive_burst_max_msec * US_PER_MS;
+
+    burst.window_usec = window;
+    burst.scale       = (window << BURST_SCALE_SHIFT) / base_usec;
 }
 
-/* Read a boolean value into ret. If the value is not set in the table or
- * otherwise cannot be read, fallback to default_ret. */
-static void read_config_bool(const toml_table_t *table, const char *key,
-                             bool default_ret, bool *ret) {
-    int maybe_ret;
-    toml_raw_t currval = toml_raw_in(table, key);
+/* Learn the interval between the previous Key Down and this one, if both are
+ * part of a typing streak. Only intervals starting at a key that is not
+ * mapped are learned: whether the ones starting at a mapped key turn into
+ * modifiers depends on the window, and leaving those out would shrink it
+ * further and further. */
+static void learn_burst_interval(const input_event *event) {
+    const bool was_mapped = burst.is_recent_down_mapped;
+    const bool had_down   = burst.has_recent_down;
+    const int64_t interval =
+        time_diff(&burst.recent_down_time, &event->time);
+
+    burst.recent_down_time      = event->time;
+    burst.has_recent_down       = true;
+    burst.is_recent_down_mapped = event->code < KEY_CNT &&
+                                  CONFIG_KEY_INDEX[event->code] != 0;
+
+    if (!had_down || was_mapped || interval <= 0 ||
+        interval > BURST_STREAK_GAP_MSEC * US_PER_MS)
+        return;
 
-    if (currval != NULL && toml_rtob(currval, &maybe_ret) != -1) {
-        *ret = maybe_ret;
+    if (burst.interval_usec == 0) {
+        burst.interval_usec  = interval;
+        burst.deviation_usec = interval / 2;
     } else {
-        *ret = default_ret;
+        const int64_t error = interval - burst.interval_usec;
+        burst.interval_usec += error / (1 << BURST_INTERVAL_GAIN_SHIFT);
+        burst.deviation_usec += (llabs(error) - burst.deviation_usec) /
+                                (1 << BURST_DEVIATION_GAIN_SHIFT);
     }
+    burst.intervals++;
+    update_burst_window();
 }
 
-/* Read a key code into ret. Supports reading an integer or a string (e.g.
- * "KEY_F"). Return value is an integer. */
-static void read_config_key_code(const toml_table_t *table, const char *key,
-                                 uint16_t *ret) {
-    int64_t maybe_ret;
-    toml_raw_t currval = toml_raw_in(table, key);
+/* Start from the cadence learned by a previous run, if any. */
+static void load_burst_state(const char *path) {
+    int64_t interval, deviation;
 
-    if (currval == NULL) {
-        fprintf(stderr, "Error: %s is not set.\n", key);
-        exit(EXIT_FAILURE);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        if (errno != ENOENT)
+            fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return;
     }
+    int n = fscanf(fp, "interval_usec %" SCNd64 " deviation_usec %" SCNd64,
+                   &interval, &deviation);
+    fclose(fp);
 
-    // First try to read it as int
-    if (toml_rtoi(currval, &maybe_ret) != -1) {
-        if (maybe_ret >= 0) {
-            *ret = (uint16_t)maybe_ret;
-            return;
-        } else {
-            fprintf(stderr, "Error: %s is negative.\n", key);
-            exit(EXIT_FAILURE);
-        }
+    if (n != 2 || interval <= 0 ||
+        interval > BURST_STREAK_GAP_MSEC * US_PER_MS || deviation < 0 ||
+        deviation > BURST_STREAK_GAP_MSEC * US_PER_MS) {
+        fprintf(stderr, "Warning: ignoring the malformed %s\n", path);
+        return;
     }
+    burst.interval_usec  = interval;
+    burst.deviation_usec = deviation;
+    update_burst_window();
+}
 
-    // If not int, it might be a string key code name.
-    char *key_code_str;
-    if (toml_rtos(currval, &key_code_str) != -1) {
-        maybe_ret = libevdev_event_code_from_name(EV_KEY, key_code_str);
-        if (maybe_ret >= 0) {
-            *ret = (uint16_t)maybe_ret;
-            free(key_code_str);
-            return;
-        } else {
-            fprintf(stderr, "Error: unknown key name %s\n", key_code_str);
-            exit(EXIT_FAILURE);
+/* Keep the learned cadence for the next run. The file is replaced atomically,
+ * as the instances of all the keyboards share it. */
+static void save_burst_state(const char *path) {
+    char tmp_path[PATH_MAX];
+
+    if (burst.interval_usec == 0)
+        return;
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path) >=
+        (int)sizeof(tmp_path)) {
+        fprintf(stderr, "Error: path too long: %s\n", path);
+        return;
+    }
+
+    int fd   = mkstemp(tmp_path);
+    FILE *fp = fd != -1 ? fdopen(fd, "w") : NULL;
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to create %s: %s\n", tmp_path,
+                strerror(errno));
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp_path);
         }
+        return;
     }
 
-    fprintf(stderr, "Error: unknown value of %s. Must be integer or string.\n",
-            key);
-    exit(EXIT_FAILURE);
+    fprintf(fp, "interval_usec %" PRId64 "\ndeviation_usec %" PRId64 "\n",
+            burst.interval_usec, burst.deviation_usec);
+    bool ok = !ferror(fp);
+    ok      = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp_path, path) == -1) {
+        fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+    }
 }
 
-/* Initialize the mapping according to the given arguments. */
-static void init_single_mapping(bool immediately_send_modifier,
-                                uint16_t key_code, uint16_t modifier_code,
-                                key_state *mapping) {
-    // clang-format off
-    *mapping = (key_state){
-        .key = key_code,
-        .immediately_send_modifier = immediately_send_modifier,
-        .ev_real_down     = {
-            .type  = EV_KEY,
-            .code  = key_code,
-            .value = EVENT_VALUE_KEY_DOWN
-        },
-        .ev_real_up       = {
-            .type  = EV_KEY,
-            .code  = key_code,
-            .value = EVENT_VALUE_KEY_UP
-        },
-        .ev_modifier_down = {
-            .type  = EV_KEY,
-            .code  = modifier_code,
-            .value = EVENT_VALUE_KEY_DOWN
-        },
-        .ev_modifier_up   = {
-            .type  = EV_KEY,
-            .code  = modifier_code,
-            .value = EVENT_VALUE_KEY_UP
-        },
-    };
-    // clang-format on
+////////////////////////////////////////////////////////////////////////////////
+/// Configuration handling
+
+/* Directory of the shared image cache, or NULL if disabled. */
+static const char *config_cache_dir = DEFAULT_CONFIG_CACHE_DIR;
+
+#ifndef STATIC_CONFIG
+
+/* Flag indicating that a TOML file was loaded already, so any further load is a
+ * reload. */
+static bool has_loaded_source = false;
+
+/* Read the whole file into a NUL terminated buffer. */
+static char *read_file(FILE *fp, size_t *size) {
+    size_t capacity = BUFSIZ, len = 0;
+    char *buf = malloc(capacity);
+
+    while (buf != NULL) {
+        len += fread(buf + len, 1, capacity - len - 1, fp);
+        if (len < capacity - 1)
+            break;
+        capacity *= 2;
+        char *grown = realloc(buf, capacity);
+        if (grown == NULL)
+            free(buf);
+        buf = grown;
+    }
+    if (buf == NULL || ferror(fp)) {
+        fprintf(stderr, "Failed to read the config file!\n");
+        free(buf);
+        return NULL;
+    }
+
+    buf[len] = '\0';
+    *size    = len;
+    return buf;
 }
 
-/* Read a single mapping from the configuration table. */
-static void read_config_mapping(const toml_table_t *table, key_state *mapping) {
-    uint16_t physical_key_code, modifier_key_code;
-    bool immediately_send_modifier;
+static void free_source(char *source, size_t size, bool is_mapped) {
+    if (is_mapped)
+        toml_unmap_file(source, size);
+    else
+        free(source);
+}
 
-    read_config_key_code(table, "physical_key", &physical_key_code);
-    read_config_key_code(table, "modifier_key", &modifier_key_code);
-    read_config_bool(table, "immediately_send_modifier",
-                     DEFAULT_IMMEDIATELY_SEND_MODIFIER,
-                     &immediately_send_modifier);
+/* Compile the TOML configuration file, or take the image of it from the
+ * cache if another instance has already compiled it. */
+static void *load_config_source(FILE *fp, const char *config_file,
+                                size_t *image_size, bool *is_mapped,
+                                bool *is_cached) {
+    size_t source_size;
+    // The file is hashed and parsed in place at the start. A reload races with
+    // the editor rewriting the file, and touching a mapping of the file shrunk
+    // meanwhile raises SIGBUS, so then it is read into memory, like anything
+    // that cannot be mapped (a pipe).
+    char *source =
+        has_loaded_source ? NULL : toml_map_file(fileno(fp), &source_size);
+    bool is_source_file = source != NULL;
+    has_loaded_source   = true;
+    if (!is_source_file)
+        source = read_file(fp, &source_size);
+    if (source == NULL)
+        return NULL;
+
+    uint64_t source_hash = config_image_source_hash(source, source_size);
+    void *image          = NULL;
+
+    if (config_cache_dir != NULL)
+        image = config_image_map_cached(config_cache_dir, config_file,
+                                        source_hash, image_size);
+    if (image != NULL) {
+        *is_mapped = *is_cached = true;
+        free_source(source, source_size, is_source_file);
+        return image;
+    }
 
-    init_single_mapping(immediately_send_modifier, physical_key_code,
-                        modifier_key_code, mapping);
+    image = config_toml_compile(source, source_hash, config_file, image_size);
+    free_source(source, source_size, is_source_file);
+    if (image == NULL || config_cache_dir == NULL ||
+        !config_image_cache(config_cache_dir, config_file, image, *image_size))
+        return image;
+
+    // Use the shared copy right away, so there is only one in memory.
+    size_t cached_size;
+    void *cached = config_image_map_cached(config_cache_dir, config_file,
+                                           source_hash, &cached_size);
+    if (cached == NULL)
+        return image;
+    free(image);
+    *image_size = cached_size;
+    *is_mapped = *is_cached = true;
+    return cached;
 }
 
-/* Read all mappings form the configuration table. */
-static void read_config_mappings(const toml_table_t *table) {
-    toml_array_t *marr;
+#endif /* STATIC_CONFIG */
 
-    marr = toml_array_in(table, "mapping");
-    if (marr == NULL || (mappings_size = toml_array_nelem(marr)) == 0) {
-        fprintf(stderr,
-                "Warning: no mappings found in the config file.\n"
-                "The plugin will work as no-op!\n");
-        return;
-    }
+/* Free the tables of the configuration, but not the structure itself. */
+static void free_config_tables(struct config *config) {
+    free(config->mappings);
+    if (config->is_image_mapped)
+        munmap(config->image, config->image_size);
+    else
+        free(config->image);
+}
+
+static void free_config(struct config *config) {
+    free_config_tables(config);
+    free(config);
+}
 
-    mappings = calloc(sizeof(*mappings), mappings_size);
-    if (mappings == NULL) {
+/* Set up the configuration backed by the given image, which it takes over. */
+static struct config *config_from_image(void *image, size_t image_size,
+                                        bool is_mapped, bool is_cached) {
+    struct config *config = calloc(1, sizeof(*config));
+    if (config == NULL) {
         fprintf(stderr, "Failed to allocate memory!\n");
-        exit(EXIT_FAILURE);
+        goto fail;
     }
+    config->image           = image;
+    config->image_size      = image_size;
+    config->is_image_mapped = is_mapped;
+    config->is_image_cached = is_cached;
+    config->settings        = *config_image_settings(image);
+    config->key_index       = config_image_key_index(image);
+    config->key_mappings =
+        config_image_mappings(image, &config->mappings_size);
+
+    // Only the state of the keys is private to the process, all the rest stays
+    // in the image.
+    if (config->mappings_size > 0) {
+        config->mappings =
+            calloc(sizeof(*config->mappings), config->mappings_size);
+        if (config->mappings == NULL) {
+            fprintf(stderr, "Failed to allocate memory!\n");
+            free(config);
+            goto fail;
+        }
+    }
+    for (int i = 0; i < config->mappings_size; i++)
+        config->mappings[i].mapping = &config->key_mappings[i];
+    return config;
+
+fail:
+    if (is_mapped)
+        munmap(image, image_size);
+    else
+        free(image);
+    return NULL;
+}
+
+#ifdef STATIC_CONFIG
 
-    for (int i = 0; i < mappings_size; i++)
-        read_config_mapping(toml_table_at(marr, i), mappings + i);
+/* The configuration is compiled in, so there is no file to load. The image is
+ * built all the same, for the code shared with the regular build. */
+static struct config *load_config(const char *config_file) {
+    size_t image_size;
+    void *image;
+
+    (void)config_file;
+    image = config_image_build(&static_config_settings, static_key_mappings,
+                               STATIC_CONFIG_MAPPINGS_SIZE, 0, &image_size);
+    if (image == NULL)
+        return NULL;
+    return config_from_image(image, image_size, false, false);
 }
 
-/* Load program configuration form the given file path. */
-static void load_config(const char *config_file) {
+#else
+
+/* Load program configuration form the given file path, which is either a TOML
+ * file or an image compiled by --compile-config. Return NULL on failure, after
+ * printing the reason to STDERR. */
+static struct config *load_config(const char *config_file) {
     FILE *fp;
-    char err_buf[TOML_ERROR_BUFFER_SIZE];
-    toml_table_t *table;
+    char magic[CONFIG_IMAGE_MAGIC_SIZE];
+    void *image;
+    size_t image_size;
+    bool is_mapped, is_cached = false;
 
     fp = fopen(config_file, "r");
     if (fp == NULL) {
         fprintf(stderr, "Failed to open config file: %s\n", config_file);
-        exit(EXIT_FAILURE);
+        return NULL;
     }
 
-    table = toml_parse_file(fp, err_buf, TOML_ERROR_BUFFER_SIZE);
-    fclose(fp);
+    size_t magic_size = fread(magic, 1, sizeof(magic), fp);
+    is_mapped         = config_image_has_magic(magic, magic_size);
+    if (is_mapped) {
+        fclose(fp);
+        image = config_image_map(config_file, &image_size);
+        if (image != NULL &&
+            !config_image_verify(image, image_size, config_file)) {
+            munmap(image, image_size);
+            image = NULL;
+        }
+    } else {
+        rewind(fp);
+        image = load_config_source(fp, config_file, &image_size, &is_mapped,
+                                   &is_cached);
+        fclose(fp);
+    }
+
+    if (image == NULL)
+        return NULL;
+    return config_from_image(image, image_size, is_mapped, is_cached);
+}
+
+#endif /* STATIC_CONFIG */
+
+/* Compile the TOML configuration file into an image file, or into a C header
+ * if as_header is set. */
+static bool compile_config(const char *config_file, const char *output_file,
+                           bool as_header) {
+    struct config *config = load_config(config_file);
+    if (config == NULL)
+        return false;
+
+    bool ok = as_header ? config_image_write_header(config->image, config_file,
+                                                    output_file)
+                        : config_image_write(config->image, config->image_size,
+                                             output_file);
+    if (ok)
+        fprintf(stderr, "Compiled %d mappings from %s into %s\n",
+                config->mappings_size, config_file, output_file);
+    free_config(config);
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Real-time mode
+
+/* Output buffer of STDOUT, so the stdio backend does not allocate it on the
+ * first write. */
+static char stdout_buf[BUFSIZ];
+
+/* In-use heap size once the set up is complete. */
+static size_t heap_baseline;
+/* Change of the in-use heap size made by the configuration reloads, which
+ * allocate by design: the new tables, and what the reload thread keeps cached
+ * in its arena. Left out of the check. */
+static int64_t reload_heap_change = 0;
+
+static size_t heap_in_use(void) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+/* Account the change of the in-use heap size since before to the reloads. */
+static void exclude_reload_heap_change(size_t before) {
+    __atomic_add_fetch(&reload_heap_change,
+                       (int64_t)heap_in_use() - (int64_t)before,
+                       __ATOMIC_RELAXED);
+}
+
+/* Touch the stack pages we might ever need, so they are already faulted in
+ * (and locked) when the events arrive. */
+static void __attribute__((noinline)) prefault_stack(void) {
+    volatile unsigned char stack[REALTIME_STACK_PREFAULT_SIZE];
+    for (size_t i = 0; i < sizeof(stack); i += 4096)
+        stack[i] = 0;
+}
 
-    if (table == NULL) {
-        fprintf(stderr, "Failed to parse config file: %s\nError: %s\n",
-                config_file, err_buf);
+/* Request SCHED_FIFO at the given priority, pin to the given CPU (unless it is
+ * negative) and lock all current and future memory. Failures are not fatal,
+ * since the plugin keeps working without real-time privileges. */
+static void enter_realtime_mode(int priority, int cpu) {
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1)
+            fprintf(stderr, "Warning: failed to pin to CPU %d: %s\n", cpu,
+                    strerror(errno));
+    }
+
+    struct sched_param param = {.sched_priority = priority};
+    if (sched_setscheduler(0, SCHED_FIFO, &param) == -1)
+        fprintf(stderr, "Warning: failed to set SCHED_FIFO priority %d: %s\n",
+                priority, strerror(errno));
+
+    setvbuf(stdout, stdout_buf, _IOFBF, sizeof(stdout_buf));
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+        fprintf(stderr, "Warning: failed to lock memory: %s\n",
+                strerror(errno));
+
+    prefault_stack();
+    memset(ev_queue_default, 0, sizeof(ev_queue_default));
+    memset(ev_queue_delayed, 0, sizeof(ev_queue_delayed));
+    memset(input_batch, 0, sizeof(input_batch));
+    memset(output_ring, 0, sizeof(output_ring));
+    memset(stats.latency_usec, 0, sizeof(stats.latency_usec));
+}
+
+/* Remember the heap usage once all the allocations of the set up are done. */
+static void finish_realtime_setup(void) {
+    heap_baseline = heap_in_use();
+}
+
+/* Complain if anything was allocated in the event loop, besides the
+ * configuration reloads. */
+static void check_realtime_heap(void) {
+    size_t in_use = heap_in_use() -
+                    __atomic_load_n(&reload_heap_change, __ATOMIC_RELAXED);
+    if (in_use != heap_baseline)
+        fprintf(stderr,
+                "Warning: heap usage changed after startup: %zu -> %zu "
+                "bytes\n",
+                heap_baseline, in_use);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Configuration reloading
+
+/* The configuration is reloaded on SIGHUP, and also when the file changes if
+ * --watch is given. A separate thread builds the new mapping table off to the
+ * side and hands it over to the main thread, which swaps it in between two
+ * events. Event handling never waits for the file to be parsed. */
+
+static const char *reload_config_file;
+static bool reload_watch_file = false;
+/* Freshly loaded configuration not yet picked up by the main thread. Whoever
+ * takes it out of here owns it. */
+static struct config *pending_config = NULL;
+static pthread_t reload_thread;
+
+static void reload_config(void) {
+    size_t heap_before        = heap_in_use();
+    struct config *new_config = load_config(reload_config_file);
+    if (new_config == NULL) {
+        fprintf(stderr, "Warning: keeping the previous configuration.\n");
+        exclude_reload_heap_change(heap_before);
+        return;
+    }
+
+    struct config *stale =
+        __atomic_exchange_n(&pending_config, new_config, __ATOMIC_ACQ_REL);
+    if (stale != NULL)
+        free_config(stale);
+    exclude_reload_heap_change(heap_before);
+}
+
+/* Start watching the directory of the config file, since editors tend to
+ * replace the file rather than write it in place. Return the inotify fd, or -1
+ * on failure. */
+static int watch_config_file(const char **file_name) {
+    static char dir[PATH_MAX];
+
+    const char *slash = strrchr(reload_config_file, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+        *file_name = reload_config_file;
+    } else {
+        size_t len = slash - reload_config_file;
+        if (len >= sizeof(dir))
+            return -1;
+        memcpy(dir, reload_config_file, len);
+        dir[len]   = '\0';
+        *file_name = slash + 1;
+        if (len == 0)
+            strcpy(dir, "/");
+    }
+
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Return true if the inotify events in buf concern the config file. */
+static bool is_config_file_changed(const char *buf, ssize_t len,
+                                   const char *file_name) {
+    bool changed = false;
+    for (const char *p = buf; p < buf + len;) {
+        const struct inotify_event *event = (const struct inotify_event *)p;
+        if (event->len > 0 && strcmp(event->name, file_name) == 0)
+            changed = true;
+        p += sizeof(struct inotify_event) + event->len;
+    }
+    return changed;
+}
+
+static void *reload_thread_main(void *arg) {
+    sigset_t *mask        = arg;
+    const char *file_name = NULL;
+
+    struct pollfd pfds[2] = {
+        {.fd = signalfd(-1, mask, SFD_CLOEXEC), .events = POLLIN},
+        {.fd = -1, .events = POLLIN},
+    };
+    if (pfds[0].fd == -1) {
+        fprintf(stderr, "Warning: SIGHUP reloading is not available: %s\n",
+                strerror(errno));
+    }
+    if (reload_watch_file) {
+        pfds[1].fd = watch_config_file(&file_name);
+        if (pfds[1].fd == -1)
+            fprintf(stderr, "Warning: cannot watch %s for changes: %s\n",
+                    reload_config_file, strerror(errno));
+    }
+
+    for (;;) {
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            return NULL;
+        }
+
+        bool reload = false;
+        if (pfds[0].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(pfds[0].fd, &info, sizeof(info)) == sizeof(info))
+                reload = true;
+        }
+        if (pfds[1].revents & POLLIN) {
+            char buf[4096]
+                __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t len = read(pfds[1].fd, buf, sizeof(buf));
+            if (len > 0 && is_config_file_changed(buf, len, file_name))
+                reload = true;
+        }
+
+        if (reload)
+            reload_config();
+    }
+}
+
+/* Start the thread reloading the configuration. Must be called before any
+ * other thread is started, so they all inherit the blocked SIGHUP. */
+static void start_reload_thread(const char *config_file, bool watch_file) {
+    static sigset_t mask;
+
+    reload_config_file = config_file;
+    reload_watch_file  = watch_file;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    if (pthread_create(&reload_thread, NULL, reload_thread_main, &mask) != 0) {
+        fprintf(stderr, "Failed to start the config reload thread!\n");
         exit(EXIT_FAILURE);
     }
+}
 
-    read_config_int(table, "burst_typing_msec", &burst_typing_msec);
-    read_config_int(table, "can_insert_letter_msec", &can_insert_letter_msec);
+/* Copy the state of the held keys from the current mappings over to the new
+ * ones, so a reload does not interrupt anything. */
+static void carry_over_key_states(struct config *new_config) {
+    for (int i = 0; i < config.mappings_size; i++) {
+        key_state *old_state = &config.mappings[i];
+        uint16_t new_index   = new_config->key_index[old_state->mapping->key];
+
+        // The counters go on with the new mapping of the key.
+        if (new_index != 0) {
+            key_state *new_state = &new_config->mappings[new_index - 1];
+            new_state->speculative_letters_sent =
+                old_state->speculative_letters_sent;
+            new_state->corrections = old_state->corrections;
+            new_state->misfires    = old_state->misfires;
+        }
+        if (!old_state->is_held)
+            continue;
 
-    read_config_mappings(table);
+        if (new_index == 0) {
+            // The key is not handled anymore. Let go of its modifier; the
+            // Key Up will pass through as is.
+            if (old_state->is_modifier_held &&
+                release_modifier(old_state->mapping))
+                enqueue_event_and_syn(&old_state->mapping->ev_modifier_up);
+            continue;
+        }
 
-    toml_free(table);
+        key_state *new_state = &new_config->mappings[new_index - 1];
+
+        new_state->recent_down_time      = old_state->recent_down_time;
+        new_state->is_held               = old_state->is_held;
+        new_state->is_modifier_held      = old_state->is_modifier_held;
+        new_state->has_sent_real_down    = old_state->has_sent_real_down;
+        new_state->is_locked_to_modifier = old_state->is_locked_to_modifier;
+        new_state->has_sent_speculative_letter =
+            old_state->has_sent_speculative_letter;
+        new_state->bigram_window_usec = old_state->bigram_window_usec;
+        new_state->is_repeating       = old_state->is_repeating;
+        new_state->recent_repeat_time = old_state->recent_repeat_time;
+
+        // Switch over to the new modifier right away.
+        if (old_state->is_modifier_held &&
+            old_state->mapping->ev_modifier_down.code !=
+                new_state->mapping->ev_modifier_down.code) {
+            if (release_modifier(old_state->mapping))
+                enqueue_event_and_syn(&old_state->mapping->ev_modifier_up);
+            if (hold_modifier(new_state->mapping))
+                enqueue_event_and_syn(&new_state->mapping->ev_modifier_down);
+        }
+    }
+}
+
+/* Swap in the configuration loaded by the reload thread, if any. */
+static inline void install_pending_config(void) {
+    // Not while a key decides: the held back events refer to its state.
+    if (__atomic_load_n(&pending_config, __ATOMIC_RELAXED) == NULL ||
+        deferred.state != NULL)
+        return;
+
+    struct config *new_config =
+        __atomic_exchange_n(&pending_config, NULL, __ATOMIC_ACQ_REL);
+    if (new_config == NULL)
+        return;
+
+    carry_over_key_states(new_config);
+    flush_events();
+
+    size_t heap_before = heap_in_use();
+    free_config_tables(&config);
+    config = *new_config;
+    free(new_config);
+    update_burst_window();
+    exclude_reload_heap_change(heap_before);
+
+    fprintf(stderr, "Configuration reloaded from %s\n", reload_config_file);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-/// Entry point
+/// Statistics
+
+/* Account for the processing delay of the event. */
+static inline void record_latency(const input_event *event) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    int64_t usec = (now.tv_sec - event->time.tv_sec) * US_PER_SECOND +
+                   now.tv_nsec / 1000 - event->time.tv_usec;
+    if (usec < 0)
+        usec = 0;
+    if (usec > stats.latency_usec_max)
+        stats.latency_usec_max = usec;
+    if (usec >= LATENCY_HISTOGRAM_SIZE)
+        usec = LATENCY_HISTOGRAM_SIZE - 1;
+    stats.latency_usec[usec]++;
+}
+
+/* Return the latency at the given percentile. */
+static int latency_percentile(uint64_t samples, double pct) {
+    uint64_t rank = (uint64_t)(samples * pct / 100.0), seen = 0;
+    for (int i = 0; i < LATENCY_HISTOGRAM_SIZE; i++) {
+        seen += stats.latency_usec[i];
+        if (seen > rank)
+            return i;
+    }
+    return LATENCY_HISTOGRAM_SIZE - 1;
+}
+
+/* Names of the decision branches in the statistics. */
+static const char *const decision_branch_names[BRANCH_CNT] = {
+    [BRANCH_LETTER_ON_RELEASE]     = "letter on release",
+    [BRANCH_LETTER_ON_OTHER_KEY]   = "letter on other key",
+    [BRANCH_MODIFIER_ON_OTHER_KEY] = "modifier on other key",
+    [BRANCH_LETTER_IN_STREAK]      = "letter in typing streak",
+};
+
+static void print_misfire_line(const char *what, uint64_t misfires,
+                               uint64_t decisions) {
+    fprintf(stderr,
+            "Misfires of %s: %" PRIu64 " of %" PRIu64 " decisions (%.1f%%)\n",
+            what, misfires, decisions, 100.0 * misfires / decisions);
+}
 
-// Input buffer for reading one event a time.
-#define INPUT_BUFSIZ (sizeof(input_event))
-static char input_buf[INPUT_BUFSIZ];
+/* Report the decisions followed by a correction, by key and by branch. */
+static void print_misfire_stats(void) {
+    uint64_t branch_decisions[BRANCH_CNT] = {0};
+    uint64_t branch_misfires[BRANCH_CNT]  = {0};
+    char what[KEY_NAME_SIZE];
+
+    for (int i = 0; i < CONFIG_MAPPINGS_SIZE; i++) {
+        const struct misfire_stats *misfires = &config.mappings[i].misfires;
+        uint64_t decisions = 0, misfired = 0;
+        for (int branch = 0; branch < BRANCH_CNT; branch++) {
+            decisions += misfires->decisions[branch];
+            misfired += misfires->misfires[branch];
+            branch_decisions[branch] += misfires->decisions[branch];
+            branch_misfires[branch] += misfires->misfires[branch];
+        }
+        if (decisions == 0)
+            continue;
+        snprintf(what, sizeof(what), "key %u", CONFIG_KEY_MAPPINGS[i].key);
+        print_misfire_line(what, misfired, decisions);
+    }
+    for (int branch = 0; branch < BRANCH_CNT; branch++) {
+        if (branch_decisions[branch] > 0)
+            print_misfire_line(decision_branch_names[branch],
+                               branch_misfires[branch],
+                               branch_decisions[branch]);
+    }
+}
 
-int main() {
+static void print_stats(void) {
+    uint64_t syscalls = io->syscall_count();
+
+    if (io == &io_backend_threaded)
+        fprintf(stderr, "I/O backend: %s, threaded\n", threaded_reader->name);
+    else
+        fprintf(stderr, "I/O backend: %s\n", io->name);
+    fprintf(stderr, "Config load: %" PRId64 " usec (%s)\n",
+            stats.config_load_usec,
+            config.is_image_cached   ? "shared cache"
+            : config.is_image_mapped ? "compiled image"
+                                     : "TOML");
+    fprintf(stderr, "Keystrokes: %" PRIu64 "\n", stats.keystrokes);
+    fprintf(stderr, "I/O syscalls: %" PRIu64 " (%.2f per keystroke)\n",
+            syscalls,
+            stats.keystrokes ? (double)syscalls / stats.keystrokes : 0.0);
+    fprintf(stderr, "Pass-through: %" PRIu64 " events in %" PRIu64 " writes\n",
+            stats.pass_through_events, stats.pass_through_writes);
+    if (CONFIG_SETTINGS.adaptive_burst_typing)
+        fprintf(stderr,
+                "Burst typing window: %" PRId64 " msec, learned from %" PRIu64
+                " intervals (average %" PRId64 " msec, deviation %" PRId64
+                " msec)\n",
+                burst.window_usec / US_PER_MS, burst.intervals,
+                burst.interval_usec / US_PER_MS,
+                burst.deviation_usec / US_PER_MS);
+    if (CONFIG_SETTINGS.require_prior_idle_msec > 0)
+        fprintf(stderr, "Typing streak letters: %" PRIu64 "\n",
+                stats.streak_letters);
+    fprintf(stderr, "Redundant modifier events held back: %" PRIu64 "\n",
+            stats.modifier_events_saved);
+    for (int i = 0; i < CONFIG_MAPPINGS_SIZE; i++) {
+        const key_state *state = &config.mappings[i];
+        if (state->speculative_letters_sent > 0)
+            fprintf(stderr,
+                    "Speculative letters of key %u: %" PRIu64
+                    ", corrected %" PRIu64 " (%.1f%%)\n",
+                    CONFIG_KEY_MAPPINGS[i].key, state->speculative_letters_sent,
+                    state->corrections,
+                    100.0 * state->corrections /
+                        state->speculative_letters_sent);
+    }
+    print_misfire_stats();
+
+    uint64_t samples = 0;
+    for (int i = 0; i < LATENCY_HISTOGRAM_SIZE; i++)
+        samples += stats.latency_usec[i];
+    if (samples > 0)
+        fprintf(stderr,
+                "Key event latency (usec): p50 %d, p99 %d, p99.9 %d, max "
+                "%" PRId64 "\n",
+                latency_percentile(samples, 50),
+                latency_percentile(samples, 99),
+                latency_percentile(samples, 99.9), stats.latency_usec_max);
+
+    if (io == &io_backend_threaded) {
+        fprintf(stderr,
+                "Output ring: max depth %zu of %d, %" PRIu64
+                " waits on full ring\n",
+                output_ring_max_depth, OUTPUT_RING_SIZE,
+                output_ring_full_waits);
+        fprintf(stderr,
+                "Writer stalls (>= %d usec): %" PRIu64 ", total %" PRId64
+                " usec, max %" PRId64 " usec\n",
+                WRITER_STALL_USEC, writer_stalls, writer_stall_usec_total,
+                writer_stall_usec_max);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Command line
+
+static void print_usage(FILE *stream, const char *program) {
+    fprintf(stream,
+            "Usage: %s [OPTION]...\n"
+            "Make the home row keys act as modifiers. Reads input events from "
+            "STDIN and\nwrites them to STDOUT.\n\n"
+            "  -c, --config FILE  configuration file (default: %s)\n"
+            "      --compile-config FILE OUTPUT\n"
+            "                     compile FILE into an image usable with -c, "
+            "and exit\n"
+            "      --generate-header FILE OUTPUT\n"
+            "                     compile FILE into a C header for `make "
+            "static`, and exit\n"
+            "      --config-cache DIR\n"
+            "                     share compiled configs with the other "
+            "instances in DIR\n"
+            "                     (default: %s)\n"
+            "      --no-config-cache\n"
+            "                     do not use the shared config cache\n"
+            "      --burst-state FILE\n"
+            "                     keep the learned burst typing window in "
+            "FILE\n"
+            "      --bigrams FILE\n"
+            "                     use the burst typing windows by key pair "
+            "from FILE\n"
+            "      --daemon SOCKET\n"
+            "                     serve home-row-fu-attach clients on SOCKET\n"
+            "  -i, --io BACKEND   I/O backend: stdio or uring (default: %s)\n"
+            "  -w, --watch        reload the configuration file when it "
+            "changes\n"
+            "  -t, --threaded     write the output from a separate thread\n"
+            "  -r, --realtime     run with SCHED_FIFO and locked memory\n"
+            "  -P, --rt-priority N\n"
+            "                     SCHED_FIFO priority (default: %d)\n"
+            "  -C, --cpu N        pin to the given CPU in real-time mode\n"
+            "  -s, --stats        print runtime statistics to STDERR on exit\n"
+            "  -h, --help         display this help and exit\n",
+            program, DEFAULT_CONFIG_FILE, DEFAULT_CONFIG_CACHE_DIR,
+            DEFAULT_IO_BACKEND, DEFAULT_RT_PRIORITY);
+}
+
+struct options {
+    const char *config_file;
+    const char *compile_config;
+    const char *compile_output;
+    bool compile_to_header;
+    const char *daemon_socket;
+    bool watch;
+    const char *io_backend;
+    bool threaded;
+    bool realtime;
+    int rt_priority;
+    int cpu;
+};
+
+/* Parse a non-negative integer argument of the option. */
+static int parse_int_arg(const char *arg, const char *option) {
+    char *end;
+    long ret = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || ret < 0 || ret > 0xffff) {
+        fprintf(stderr, "Error: invalid value of %s: %s\n", option, arg);
+        exit(EXIT_FAILURE);
+    }
+    return (int)ret;
+}
+
+/* Value of the options without a short form. */
+enum {
+    OPTION_COMPILE_CONFIG = 256,
+    OPTION_CONFIG_CACHE,
+    OPTION_NO_CONFIG_CACHE,
+    OPTION_DAEMON,
+    OPTION_GENERATE_HEADER,
+    OPTION_BURST_STATE,
+    OPTION_BIGRAMS,
+};
+
+static void parse_args(int argc, char *argv[], struct options *options) {
+    static const struct option long_options[] = {
+        {"config", required_argument, NULL, 'c'},
+        {"watch", no_argument, NULL, 'w'},
+        {"io", required_argument, NULL, 'i'},
+        {"threaded", no_argument, NULL, 't'},
+        {"realtime", no_argument, NULL, 'r'},
+        {"rt-priority", required_argument, NULL, 'P'},
+        {"cpu", required_argument, NULL, 'C'},
+        {"stats", no_argument, NULL, 's'},
+        {"help", no_argument, NULL, 'h'},
+        {"compile-config", required_argument, NULL, OPTION_COMPILE_CONFIG},
+        {"config-cache", required_argument, NULL, OPTION_CONFIG_CACHE},
+        {"no-config-cache", no_argument, NULL, OPTION_NO_CONFIG_CACHE},
+        {"daemon", required_argument, NULL, OPTION_DAEMON},
+        {"generate-header", required_argument, NULL, OPTION_GENERATE_HEADER},
+        {"burst-state", required_argument, NULL, OPTION_BURST_STATE},
+        {"bigrams", required_argument, NULL, OPTION_BIGRAMS},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:wi:trP:C:sh", long_options, NULL)) !=
+           -1) {
+        switch (opt) {
+        case 'c':
+            options->config_file = optarg;
+            break;
+        case OPTION_COMPILE_CONFIG:
+            options->compile_config = optarg;
+            break;
+        case OPTION_CONFIG_CACHE:
+            config_cache_dir = optarg;
+            break;
+        case OPTION_NO_CONFIG_CACHE:
+            config_cache_dir = NULL;
+            break;
+        case OPTION_DAEMON:
+            options->daemon_socket = optarg;
+            break;
+        case OPTION_GENERATE_HEADER:
+            options->compile_config    = optarg;
+            options->compile_to_header = true;
+            break;
+        case OPTION_BURST_STATE:
+            burst_state_file = optarg;
+            break;
+        case OPTION_BIGRAMS:
+            if (!bigram_table_read(optarg, &bigrams))
+                exit(EXIT_FAILURE);
+            has_bigrams = true;
+            break;
+        case 'w':
+            options->watch = true;
+            break;
+        case 'i':
+            options->io_backend = optarg;
+            break;
+        case 't':
+            options->threaded = true;
+            break;
+        case 'r':
+            options->realtime = true;
+            break;
+        case 'P':
+            options->rt_priority = parse_int_arg(optarg, "--rt-priority");
+            break;
+        case 'C':
+            options->cpu = parse_int_arg(optarg, "--cpu");
+            break;
+        case 's':
+            stats_enabled = true;
+            break;
+        case 'h':
+            print_usage(stdout, argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            print_usage(stderr, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The only positional argument is the output of --compile-config and
+    // --generate-header.
+    if (options->compile_config != NULL && optind < argc)
+        options->compile_output = argv[optind++];
+    if (optind < argc ||
+        (options->compile_config != NULL && options->compile_output == NULL)) {
+        print_usage(stderr, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Event loop
+
+/* Process the events from STDIN until EOF. The configuration must be loaded. */
+static int run_engine(const struct options *options) {
     input_event curr_event;
 
-    setbuffer(stdin, input_buf, INPUT_BUFSIZ);
+    // First of all threads, so it keeps the default scheduling policy and all
+    // the others inherit the blocked SIGHUP.
+    start_reload_thread(options->config_file, options->watch);
+
+    if (burst_state_file != NULL)
+        load_burst_state(burst_state_file);
+    update_burst_window();
 
-    // TODO: read config file name as cli param
-    load_config(DEFAULT_CONFIG_FILE);
+    select_io_backend(options->io_backend);
+    // Before starting the writer thread, so it inherits the scheduling policy
+    // and its stack gets locked.
+    if (options->realtime)
+        enter_realtime_mode(options->rt_priority, options->cpu);
+    if (options->threaded)
+        start_writer_thread();
+    if (options->realtime)
+        finish_realtime_setup();
 
     while (read_event(&curr_event)) {
+        install_pending_config();
+
+        // The scan events are the clock of the policies, also while the
+        // events are held back.
         if (curr_event.type == EV_MSC && curr_event.code == MSC_SCAN) {
             recent_scan = curr_event;
+            if (deferred.state == NULL)
+                continue;
+        }
+
+        if (deferred.state != NULL) {
+            defer_event(&curr_event);
             continue;
         }
 
         if (curr_event.type != EV_KEY) {
-            write_event(&curr_event);
+            if (!is_event_replayed && are_mappings_idle()) {
+                write_pass_through_run();
+            } else {
+                if (curr_event.type == EV_REL || curr_event.type == EV_ABS)
+                    recent_pointer_time = curr_event.time;
+                write_event(&curr_event);
+            }
             continue;
         }
 
-        bool found_handler = false;
-        for (int i = 0; i < mappings_size; i++) {
-            if (handle_key(&curr_event, &mappings[i]))
-                found_handler = true;
-        }
+        if (defer_key_down(&curr_event))
+            continue;
+
+        if (curr_event.value == EVENT_VALUE_KEY_DOWN)
+            stats.keystrokes++;
+        if (stats_enabled)
+            record_latency(&curr_event);
+
+        for (int i = 0; i < CONFIG_MAPPINGS_SIZE; i++)
+            handle_key(&curr_event, &config.mappings[i],
+                       &CONFIG_KEY_MAPPINGS[i]);
 
-        if (!found_handler) {
+        if ((curr_event.code >= KEY_CNT ||
+             CONFIG_KEY_INDEX[curr_event.code] == 0) &&
+            track_physical_modifier(&curr_event)) {
             enqueue_event(&recent_scan);
             enqueue_event(&curr_event);
         }
 
         flush_events();
+
+        if (curr_event.value == EVENT_VALUE_KEY_DOWN) {
+            recent_key_down_time = curr_event.time;
+            recent_key_down_code = curr_event.code;
+            has_recent_key_down  = true;
+            if (curr_event.code == KEY_BACKSPACE)
+                match_backspace(&curr_event);
+            else if (curr_event.code >= KEY_CNT ||
+                     CONFIG_KEY_INDEX[curr_event.code] == 0)
+                recent_unmapped_down_time = curr_event.time;
+            if (CONFIG_SETTINGS.adaptive_burst_typing)
+                learn_burst_interval(&curr_event);
+        }
+    }
+
+    io->finish();
+
+    if (options->realtime)
+        check_realtime_heap();
+    if (stats_enabled)
+        print_stats();
+    if (burst_state_file != NULL && CONFIG_SETTINGS.adaptive_burst_typing)
+        save_burst_state(burst_state_file);
+
+    return EXIT_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Daemon mode
+
+/* With --daemon the configuration is loaded once, and a worker process is
+ * forked in advance and waits for a connection on the Unix socket. The attach
+ * client (home-row-fu-attach) sends over its STDIN and STDOUT, and the worker
+ * runs the event loop on them right away: it has nothing left to load or
+ * link. As soon as a worker gets a connection, the daemon forks the next one.
+ * When the event loop ends, the worker sends its exit status back to the
+ * client, which exits with it. */
+
+static pid_t *daemon_workers      = NULL;
+static size_t daemon_workers_size = 0;
+/* Signals, the notifications of taken workers and config file changes, and
+ * the listening socket. The worker closes all but the last. */
+static struct pollfd daemon_pollfds[4];
+
+static void add_daemon_worker(pid_t pid) {
+    pid_t *workers = realloc(daemon_workers,
+                             (daemon_workers_size + 1) * sizeof(*workers));
+    if (workers == NULL) {
+        fprintf(stderr, "Failed to allocate memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    daemon_workers                        = workers;
+    daemon_workers[daemon_workers_size++] = pid;
+}
+
+static void remove_daemon_worker(pid_t pid) {
+    for (size_t i = 0; i < daemon_workers_size; i++) {
+        if (daemon_workers[i] == pid) {
+            daemon_workers[i] = daemon_workers[--daemon_workers_size];
+            return;
+        }
+    }
+}
+
+/* Return the listening socket passed by systemd socket activation, or -1. */
+static int activated_socket(void) {
+    const char *pid = getenv("LISTEN_PID"), *fds = getenv("LISTEN_FDS");
+    if (pid == NULL || fds == NULL || atol(pid) != getpid() ||
+        atoi(fds) != 1)
+        return -1;
+    fcntl(DAEMON_ACTIVATED_SOCKET_FD, F_SETFD, FD_CLOEXEC);
+    return DAEMON_ACTIVATED_SOCKET_FD;
+}
+
+static int listen_on_socket(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    int fd = activated_socket();
+    if (fd != -1)
+        return fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to create the socket: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        chmod(path, DAEMON_SOCKET_MODE) == -1 ||
+        listen(fd, DAEMON_LISTEN_BACKLOG) == -1) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/* Receive STDIN and STDOUT of the client and put them in place of ours. */
+static bool receive_client_fds(int conn) {
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != 1)
+        return false;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+        return false;
+
+    int fds[2];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    bool ok = dup2(fds[0], STDIN_FILENO) != -1 &&
+              dup2(fds[1], STDOUT_FILENO) != -1;
+    close(fds[0]);
+    close(fds[1]);
+    return ok;
+}
+
+/* Replace the current configuration with a freshly loaded one. */
+static void reload_daemon_config(void) {
+    struct config *new_config = load_config(reload_config_file);
+    if (new_config == NULL) {
+        fprintf(stderr, "Warning: keeping the previous configuration.\n");
+        return;
+    }
+    free_config_tables(&config);
+    config = *new_config;
+    free(new_config);
+    update_burst_window();
+    fprintf(stderr, "Configuration reloaded from %s\n", reload_config_file);
+}
+
+/* Body of a worker: wait for a client, tell the daemon it is taken, then run
+ * the event loop for the client. Never returns. */
+static void run_daemon_worker(int listen_fd, int taken_fd,
+                              const sigset_t *orig_mask,
+                              const struct options *options) {
+    sigset_t mask = *orig_mask, hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+
+    for (int i = 0; i < 3; i++) {
+        if (daemon_pollfds[i].fd != -1)
+            close(daemon_pollfds[i].fd);
+    }
+    // SIGHUP stays blocked: the daemon sends it to the spare worker when the
+    // configuration changes, and it is picked up below or by the reload
+    // thread.
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_SETMASK, &mask, NULL);
+
+    int conn;
+    do {
+        conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    } while (conn == -1 && errno == EINTR);
+    if (conn == -1) {
+        fprintf(stderr, "Failed to accept a client: %s\n", strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    pid_t pid = getpid();
+    if (write(taken_fd, &pid, sizeof(pid)) != sizeof(pid))
+        _exit(EXIT_FAILURE);
+    close(taken_fd);
+    close(listen_fd);
+
+    if (!receive_client_fds(conn)) {
+        fprintf(stderr, "Failed to receive the client file descriptors\n");
+        _exit(EXIT_FAILURE);
+    }
+
+    const struct timespec no_wait = {0, 0};
+    if (sigtimedwait(&hup, NULL, &no_wait) == SIGHUP)
+        reload_daemon_config();
+
+    unsigned char status = run_engine(options);
+    if (write(conn, &status, sizeof(status)) == -1)
+        fprintf(stderr, "Failed to report to the client: %s\n",
+                strerror(errno));
+    exit(status);
+}
+
+static pid_t fork_daemon_worker(int listen_fd, int taken_fd,
+                                const sigset_t *orig_mask,
+                                const struct options *options) {
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "Failed to fork a worker: %s\n", strerror(errno));
+        return -1;
     }
+    if (pid == 0)
+        run_daemon_worker(listen_fd, taken_fd, orig_mask, options);
+    return pid;
+}
+
+static int run_daemon(const struct options *options) {
+    sigset_t mask, orig_mask;
+    int taken_pipe[2];
+    const char *file_name = NULL;
+
+    int listen_fd = listen_on_socket(options->daemon_socket);
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &orig_mask);
+
+    reload_config_file = options->config_file;
+    struct pollfd *pfds = daemon_pollfds;
+    for (int i = 0; i < 4; i++)
+        pfds[i] = (struct pollfd){.fd = -1, .events = POLLIN};
+    pfds[0].fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (pfds[0].fd == -1 || pipe2(taken_pipe, O_CLOEXEC) == -1) {
+        fprintf(stderr, "Failed to set up the daemon: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    pfds[1].fd = taken_pipe[0];
+    if (options->watch) {
+        pfds[2].fd = watch_config_file(&file_name);
+        if (pfds[2].fd == -1)
+            fprintf(stderr, "Warning: cannot watch %s for changes: %s\n",
+                    reload_config_file, strerror(errno));
+    }
+
+    pid_t spare = fork_daemon_worker(listen_fd, taken_pipe[1], &orig_mask,
+                                     options);
+    fprintf(stderr, "Listening on %s\n", options->daemon_socket);
+
+    for (;;) {
+        // Without a spare, watch for the clients queuing up ourselves.
+        pfds[3].fd = spare == -1 ? listen_fd : -1;
+        int ready  = poll(pfds, 4, spare == -1 ? DAEMON_SPARE_DELAY_MSEC : -1);
+        if (ready == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            pid_t taken;
+            if (read(taken_pipe[0], &taken, sizeof(taken)) == sizeof(taken)) {
+                add_daemon_worker(taken);
+                spare = -1;
+            }
+        }
+
+        bool reload = false;
+        if (pfds[2].revents & POLLIN) {
+            char buf[4096]
+                __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t len = read(pfds[2].fd, buf, sizeof(buf));
+            if (len > 0 && is_config_file_changed(buf, len, file_name))
+                reload = true;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(pfds[0].fd, &info, sizeof(info)) != sizeof(info))
+                continue;
+
+            if (info.ssi_signo == SIGCHLD) {
+                pid_t pid;
+                while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+                    remove_daemon_worker(pid);
+                    if (pid == spare)
+                        spare = -1;
+                }
+            } else if (info.ssi_signo == SIGHUP) {
+                // The workers with --watch notice file changes by themselves.
+                reload = true;
+                for (size_t i = 0; i < daemon_workers_size; i++)
+                    kill(daemon_workers[i], SIGHUP);
+            } else {
+                break;
+            }
+        }
 
+        if (reload) {
+            reload_daemon_config();
+            // The spare still has the old configuration, let it reload too.
+            if (spare != -1)
+                kill(spare, SIGHUP);
+        }
+        // Fork the next spare once the last one had the time to process the
+        // first events of its client, unless another client is waiting.
+        // Forking right away would compete with it for the CPU.
+        if (spare == -1 && (ready == 0 || (pfds[3].revents & POLLIN)))
+            spare = fork_daemon_worker(listen_fd, taken_pipe[1], &orig_mask,
+                                       options);
+    }
+
+    if (spare != -1)
+        kill(spare, SIGTERM);
+    for (size_t i = 0; i < daemon_workers_size; i++)
+        kill(daemon_workers[i], SIGTERM);
+    if (activated_socket() == -1)
+        unlink(options->daemon_socket);
     return EXIT_SUCCESS;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+/// Entry point
+
+int main(int argc, char *argv[]) {
+    struct options options = {
+        .config_file       = DEFAULT_CONFIG_FILE,
+        .compile_config    = NULL,
+        .compile_output    = NULL,
+        .compile_to_header = false,
+        .daemon_socket     = NULL,
+        .watch             = false,
+        .io_backend        = DEFAULT_IO_BACKEND,
+        .threaded          = false,
+        .realtime          = false,
+        .rt_priority       = DEFAULT_RT_PRIORITY,
+        .cpu               = -1,
+    };
+
+    parse_args(argc, argv, &options);
+
+    if (options.compile_config != NULL)
+        return compile_config(options.compile_config, options.compile_output,
+                              options.compile_to_header)
+                   ? EXIT_SUCCESS
+                   : EXIT_FAILURE;
+
+    int64_t load_start            = monotonic_usec();
+    struct config *initial_config = load_config(options.config_file);
+    if (initial_config == NULL)
+        exit(EXIT_FAILURE);
+    stats.config_load_usec = monotonic_usec() - load_start;
+    config = *initial_config;
+    free(initial_config);
+
+    if (options.daemon_socket != NULL)
+        return run_daemon(&options);
+    return run_engine(&options);
+}
+
 // Local Variables:
 // compile-command: "meson compile -C build"
 // End:
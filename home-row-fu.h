@@ -25,6 +25,9 @@
 // Author: Andriy B. Kmit' <dev@madand.net>
 // URL: https://github.com/madand/interception-home-row-fu
 
+#ifndef HOME_ROW_FU_H
+#define HOME_ROW_FU_H
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <linux/input.h>  // struct input_event, KEY_A ...
@@ -36,6 +39,20 @@
 #define DEFAULT_BURST_TYPING_MSEC 200
 #define DEFAULT_CAN_INSERT_LETTER_MSEC 700
 #define DEFAULT_IMMEDIATELY_SEND_MODIFIER false
+#define DEFAULT_HOLD_TAP_POLICY HOLD_TAP_TIMER
+#define DEFAULT_BILATERAL_COMBINATIONS false
+#define DEFAULT_SPECULATIVE_LETTERS false
+#define DEFAULT_CORRECTION_KEY KEY_BACKSPACE
+#define DEFAULT_ADAPTIVE_BURST_TYPING false
+#define DEFAULT_ADAPTIVE_BURST_MIN_MSEC 100
+#define DEFAULT_ADAPTIVE_BURST_MAX_MSEC 300
+#define DEFAULT_REQUIRE_PRIOR_IDLE_MSEC 0
+#define DEFAULT_KEY_REPEAT_DELAY_MSEC 0
+#define DEFAULT_KEY_REPEAT_INTERVAL_MSEC 33
+#define DEFAULT_IO_BACKEND "stdio"
+#define DEFAULT_RT_PRIORITY 50
+#define DEFAULT_CONFIG_CACHE_DIR "/dev/shm"
+#define DEFAULT_DAEMON_SOCKET "/run/home-row-fu.sock"
 
 ////////////////////////////////////////////////////////////////////////////////
 // Internal constants
@@ -43,7 +60,7 @@
 /* Key event value constants */
 #define EVENT_VALUE_KEY_UP 0
 #define EVENT_VALUE_KEY_DOWN 1
-#define EVENT_VALUE_KEY_REPEAT 3
+#define EVENT_VALUE_KEY_REPEAT 2
 
 /* Microseconds per millisecond */
 #define US_PER_MS 1000
@@ -51,7 +68,61 @@
 #define US_PER_SECOND (1000 * US_PER_MS)
 
 #define EVENT_BUFFER_SIZE 16
+/* Room for the events held back while a key decides between its letter and its
+ * modifier, three per key event (MSC_SCAN, EV_KEY and SYN_REPORT). When full,
+ * the key decides by the timer. */
+#define DEFERRED_EVENTS_SIZE 48
+/* Recent decisions of a key matched against the corrections following them,
+ * and how soon the corrections must follow. */
+#define MISFIRE_RING_SIZE 4
+#define MISFIRE_WINDOW_MSEC 1000
+/* Left and right Ctrl, Shift, Alt and Meta. */
+#define MODIFIER_KEYS_CNT 8
+/* Maximum number of events taken from the I/O backend at once. */
+#define INPUT_BATCH_SIZE 64
+/* Capacity of the ring between the main and the writer thread. Must be a power
+ * of two. */
+#define OUTPUT_RING_SIZE 1024
+/* How long the main thread sleeps between the checks of a full ring. */
+#define OUTPUT_RING_FULL_SLEEP_USEC 100
+/* A write taking at least this long counts as a stall of the consumer. */
+#define WRITER_STALL_USEC 1000
+/* How much of the stack to fault in up front in real-time mode. */
+#define REALTIME_STACK_PREFAULT_SIZE (128 * 1024)
+/* First file descriptor passed by systemd socket activation. */
+#define DAEMON_ACTIVATED_SOCKET_FD 3
+#define DAEMON_SOCKET_MODE 0600
+#define DAEMON_LISTEN_BACKLOG 16
+/* How long the daemon waits before forking a new spare worker when the
+ * previous one got a client. */
+#define DAEMON_SPARE_DELAY_MSEC 50
+/* Number of 1 usec buckets of the event latency histogram. */
+#define LATENCY_HISTOGRAM_SIZE 10000
 #define TOML_ERROR_BUFFER_SIZE 200
+/* Room for the longest key name in input-event-codes.h, with the NUL. */
+#define KEY_NAME_SIZE 32
+/* Room for a raw config value we read, with the NUL. Longer ones cannot be
+ * valid. */
+#define CONFIG_VALUE_SIZE 128
+/* Initial number of mappings room is made for while reading the config. */
+#define CONFIG_MAPPINGS_CAPACITY 8
+/* Returned by the config reading callbacks to stop the parse, after they have
+ * reported the error. */
+#define CONFIG_READ_FAILED 1
+/* Alignment of the tables in a compiled config image. */
+#define CONFIG_IMAGE_ALIGN 16
+/* Key Downs further apart than this are not part of a typing streak, and the
+ * adaptive burst typing window does not learn the interval. */
+#define BURST_STREAK_GAP_MSEC 1000
+/* Weights of a new interval in the moving averages of the adaptive burst
+ * typing window, as shifts: 1/8 for the interval and 1/4 for its deviation, as
+ * in the RTT estimator of TCP. */
+#define BURST_INTERVAL_GAIN_SHIFT 3
+#define BURST_DEVIATION_GAIN_SHIFT 2
+/* The learned window covers the average interval plus this many deviations. */
+#define BURST_WINDOW_DEVIATIONS 4
+/* Fixed point of the scale of the burst typing thresholds. */
+#define BURST_SCALE_SHIFT 16
 
 #define ensure_buffer_not_full(buf_var, size_var)                        \
     if (size_var >= EVENT_BUFFER_SIZE) {                                 \
@@ -62,9 +133,93 @@
 
 typedef struct input_event input_event;
 
-struct key_state {
+/* Hand a key is typed with, for the per-hand defaults and the bilateral
+ * combinations. */
+enum key_hand { HAND_NONE, HAND_LEFT, HAND_RIGHT, HAND_CNT };
+
+/* How a held key decides between its letter and its modifier when another key
+ * goes down, see hold_tap_policies in home-row-fu.c. */
+enum hold_tap_policy {
+    HOLD_TAP_TIMER,
+    HOLD_TAP_HOLD_ON_OTHER_KEY_PRESS,
+    HOLD_TAP_PERMISSIVE_HOLD,
+    HOLD_TAP_BALANCED,
+    HOLD_TAP_POLICY_CNT,
+};
+
+/* Immutable part of a mapping, as read from the configuration file. This is
+ * plain data without pointers, so it can be stored in a compiled config image
+ * as is. */
+struct key_mapping {
     /* Key code of the physical key. */
     uint16_t key;
+    /* Flag indicating that we want to simulate modifier press immediately after
+     * the key was pressed. Good with Ctrl to allow a Ctrl+Mouse scroll etc.,
+     * but should probably be false for Alt since GUI apps respond to Alt press
+     * by activating the main menu. */
+    bool immediately_send_modifier;
+    /* Hand of the key (enum key_hand). */
+    uint8_t hand;
+    /* Policy of the key (enum hold_tap_policy). */
+    uint8_t hold_tap_policy;
+    /* Flag indicating that only the keys of the other hand can make the key a
+     * modifier; a key of the same hand makes it the letter right away, as in a
+     * roll. */
+    bool bilateral_combinations;
+    /* Flag indicating that the key types its letter at the Key Down already,
+     * speculatively, and takes it back with the correction key if it turns
+     * out to be a modifier. No effect with immediately_send_modifier. */
+    bool speculative_letters;
+    /* Thresholds of the key in microseconds, resolved at load from the
+     * mapping, the defaults of its hand and the global settings. See
+     * can_lock_to_modifier() and can_send_real_down(). */
+    int64_t burst_typing_usec;
+    int64_t can_insert_letter_usec;
+    // Prototypes of Down and Up events.
+    input_event ev_real_down;
+    input_event ev_real_up;
+    input_event ev_modifier_down;
+    input_event ev_modifier_up;
+    input_event ev_correction_down;
+    input_event ev_correction_up;
+};
+
+typedef struct key_mapping key_mapping;
+
+/* How a handled key got decided, for the misfire estimator. */
+enum decision_branch {
+    /* Released alone, soon enough to insert the letter. */
+    BRANCH_LETTER_ON_RELEASE,
+    /* Another key went down and the hold/tap policy decided. */
+    BRANCH_LETTER_ON_OTHER_KEY,
+    BRANCH_MODIFIER_ON_OTHER_KEY,
+    /* Pressed in a typing streak, see require_prior_idle_msec. */
+    BRANCH_LETTER_IN_STREAK,
+    BRANCH_CNT
+};
+
+/* A recent decision of a key. */
+struct decision_record {
+    struct timeval time;
+    /* enum decision_branch. */
+    uint8_t branch;
+    /* Flag indicating that a correction has been matched to it already. */
+    bool is_misfire;
+};
+
+/* Decisions of a key, and those of them followed by a correction soon: a
+ * BackSpace, or the key pressed again and made a modifier after it typed its
+ * letter. */
+struct misfire_stats {
+    struct decision_record recent[MISFIRE_RING_SIZE];
+    uint8_t recent_pos;
+    uint64_t decisions[BRANCH_CNT];
+    uint64_t misfires[BRANCH_CNT];
+};
+
+struct key_state {
+    /* What the key is mapped to. */
+    const key_mapping *mapping;
     /* Time of the most recent Key Down event. */
     struct timeval recent_down_time;
     /* Flag indicating that the key is currently down. */
@@ -77,16 +232,62 @@ struct key_state {
     bool has_sent_real_down;
     /* Flag indicating that the key has became a modifier until released. */
     bool is_locked_to_modifier;
-    /* Flag indicating that we want to simulate modifier press immediately after
-     * the key was pressed. Good with Ctrl to allow a Ctrl+Mouse scroll etc.,
-     * but should probably be false for Alt since GUI apps respond to Alt press
-     * by activating the main menu. */
-    bool immediately_send_modifier;
-    // Prototypes of Down and Up events.
-    input_event ev_real_down;
-    input_event ev_real_up;
-    input_event ev_modifier_down;
-    input_event ev_modifier_up;
+    /* Flag indicating that the letter was typed at the Key Down already (Down
+     * and Up), see key_mapping.speculative_letters. */
+    bool has_sent_speculative_letter;
+    /* Flag indicating that the key repeats its letter, held alone past the
+     * repeat delay, and the time of the last repeat. */
+    bool is_repeating;
+    struct timeval recent_repeat_time;
+    /* Burst typing window of the current press by its bigram, 0 if none. See
+     * bigram_burst_typing_usec(). */
+    int64_t bigram_window_usec;
+    /* Letters typed speculatively, and how many of them were taken back. */
+    uint64_t speculative_letters_sent;
+    uint64_t corrections;
+    struct misfire_stats misfires;
 };
 
 typedef struct key_state key_state;
+
+/* Global settings of the configuration file. The thresholds are the defaults
+ * of the mappings which set them neither themselves nor for their hand. */
+struct config_settings {
+    int64_t burst_typing_msec;
+    int64_t can_insert_letter_msec;
+    /* Bounds of the learned burst typing window. */
+    int64_t adaptive_burst_min_msec;
+    int64_t adaptive_burst_max_msec;
+    /* A mapped key pressed sooner than this after the previous Key Down of any
+     * key is a letter right away. 0 to disable. */
+    int64_t require_prior_idle_msec;
+    /* A key held alone this much longer than can_insert_letter_msec starts
+     * repeating its letter every key_repeat_interval_msec. 0 to disable. */
+    int64_t key_repeat_delay_msec;
+    int64_t key_repeat_interval_msec;
+    /* Flag indicating that the burst typing thresholds follow the typing
+     * cadence, scaled by the learned window relative to burst_typing_msec. */
+    bool adaptive_burst_typing;
+};
+
+/* Everything read from the configuration file, plus the state of the handled
+ * keys. */
+struct config {
+    struct config_settings settings;
+    /* Mapping table and the index of it by key code (0 means the key is not
+     * handled, otherwise it is the mapping index plus one). Both point into
+     * the compiled image below. */
+    const key_mapping *key_mappings;
+    const uint16_t *key_index;
+    /* State of each of the mapped keys. */
+    key_state *mappings;
+    int mappings_size;
+    /* Compiled image backing the tables above: either on the heap or mapped
+     * from a file, possibly the shared cache. */
+    void *image;
+    size_t image_size;
+    bool is_image_mapped;
+    bool is_image_cached;
+};
+
+#endif /* HOME_ROW_FU_H */
@@ -0,0 +1,385 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 - 2021 Andriy B. Kmit'
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// Author: Andriy B. Kmit' <dev@madand.net>
+// URL: https://github.com/madand/interception-home-row-fu
+
+#include <errno.h>
+#include <stdio.h>   // fprintf
+#include <stdlib.h>  // exit, EXIT_FAILURE
+#include <string.h>  // memcpy, memset
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>  // syscall, close
+#include <linux/io_uring.h>
+
+#include "io-uring.h"
+
+/* Submission queue size. We never have more than a read and a couple of
+ * writes in flight. */
+#define URING_ENTRIES 8
+/* Size of each of the two input buffers. */
+#define URING_READ_BUF_SIZE (64 * sizeof(struct input_event))
+/* Capacity (in events) of each of the two output buffers. */
+#define URING_WRITE_BUF_EVENTS 256
+
+/* user_data tags of the submitted operations. */
+#define URING_TAG_READ 1
+#define URING_TAG_WRITE 2
+
+static int ring_fd = -1, ring_in_fd, ring_out_fd;
+
+static struct {
+    unsigned *head, *tail, *mask, *array;
+    unsigned entries;
+    /* Tail as seen by us, i.e. including the prepared but not yet submitted
+     * entries. */
+    unsigned local_tail;
+    /* Number of prepared entries not yet passed to io_uring_enter(2). */
+    unsigned to_submit;
+} sq;
+
+static struct {
+    unsigned *head, *tail, *mask;
+    struct io_uring_cqe *cqes;
+} cq;
+
+static struct io_uring_sqe *sqes;
+
+static uint64_t enter_count = 0;
+
+/* Double-buffered input. Events are consumed from read_buf[read_cur] while the
+ * read into the other buffer is in flight. */
+static unsigned char read_buf[2][URING_READ_BUF_SIZE];
+static size_t read_fill[2], read_pos;
+static int read_cur = 0;
+/* Set when the in-flight read has completed, read_res holds its result. The
+ * buffers are switched only after the current one is drained. */
+static bool read_completed = false, read_eof = false;
+static int read_res;
+/* Number of bytes of a partial event carried over to the start of the buffer
+ * the in-flight read goes to. */
+static size_t read_carry;
+
+/* Double-buffered output. Events are accumulated in write_buf[write_cur] while
+ * the other buffer is being written. */
+static struct input_event write_buf[2][URING_WRITE_BUF_EVENTS];
+static size_t write_count[2];
+static int write_cur = 0;
+static bool write_inflight = false;
+static size_t write_total, write_done;
+
+////////////////////////////////////////////////////////////////////////////////
+/// Ring primitives
+
+static inline int sys_io_uring_setup(unsigned entries,
+                                     struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int sys_io_uring_enter(unsigned to_submit, unsigned min_complete,
+                                     unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static inline int sys_io_uring_register(unsigned opcode, void *arg,
+                                        unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+/* Prepare a read or write SQE. It is submitted by the next uring_enter(). */
+static void prep_rw(int opcode, int fd, void *addr, size_t len,
+                    uint64_t tag) {
+    unsigned head = __atomic_load_n(sq.head, __ATOMIC_ACQUIRE);
+    if (sq.local_tail - head >= sq.entries) {
+        fprintf(stderr, "Error in prep_rw(): submission queue is full.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned idx             = sq.local_tail & *sq.mask;
+    struct io_uring_sqe *sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = opcode;
+    sqe->fd        = fd;
+    sqe->addr      = (uint64_t)(uintptr_t)addr;
+    sqe->len       = len;
+    sqe->off       = (uint64_t)-1;  // use the file position, pipes have none
+    sqe->user_data = tag;
+    sq.array[idx]  = idx;
+
+    __atomic_store_n(sq.tail, ++sq.local_tail, __ATOMIC_RELEASE);
+    sq.to_submit++;
+}
+
+static void prep_read(void) {
+    int target = !read_cur;
+    prep_rw(IORING_OP_READ, ring_in_fd, read_buf[target] + read_carry,
+            URING_READ_BUF_SIZE - read_carry, URING_TAG_READ);
+}
+
+/* Write the rest of the in-flight output buffer. */
+static void prep_write_rest(void) {
+    unsigned char *base = (unsigned char *)write_buf[!write_cur];
+    prep_rw(IORING_OP_WRITE, ring_out_fd, base + write_done,
+            write_total - write_done, URING_TAG_WRITE);
+}
+
+/* Start writing the accumulated output, unless a write is already in flight.
+ * Writes to a pipe must not overlap, otherwise the kernel may reorder them. */
+static void prep_pending_write(void) {
+    if (write_inflight || write_count[write_cur] == 0)
+        return;
+
+    write_total    = write_count[write_cur] * sizeof(struct input_event);
+    write_done     = 0;
+    write_inflight = true;
+    write_cur      = !write_cur;
+    prep_write_rest();
+}
+
+static void handle_completion(uint64_t tag, int res) {
+    if (tag == URING_TAG_READ) {
+        read_completed = true;
+        read_res       = res;
+        return;
+    }
+
+    if (res < 0) {
+        fprintf(stderr, "Error in io_uring write: %s\n", strerror(-res));
+        exit(EXIT_FAILURE);
+    }
+
+    write_done += res;
+    if (write_done < write_total) {
+        prep_write_rest();
+        return;
+    }
+
+    write_count[!write_cur] = 0;
+    write_inflight          = false;
+}
+
+/* Handle all the available completions. The completion queue is shared
+ * memory, so this takes no syscall. */
+static void reap_completions(void) {
+    unsigned head = *cq.head;
+    while (head != __atomic_load_n(cq.tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &cq.cqes[head & *cq.mask];
+        head++;
+        handle_completion(cqe->user_data, cqe->res);
+    }
+    __atomic_store_n(cq.head, head, __ATOMIC_RELEASE);
+}
+
+/* Submit the prepared SQEs, wait for min_complete completions and handle all
+ * the available ones. */
+static void uring_enter(unsigned min_complete) {
+    enter_count++;
+    int ret = sys_io_uring_enter(sq.to_submit, min_complete,
+                                 min_complete ? IORING_ENTER_GETEVENTS : 0);
+    if (ret < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "Error in io_uring_enter: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        sq.to_submit -= ret;
+    }
+
+    reap_completions();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Public interface
+
+bool uring_init(int in_fd, int out_fd) {
+#ifdef __NR_io_uring_setup
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (ring_fd < 0)
+        return false;
+
+    // IORING_OP_READ and IORING_OP_WRITE need Linux 5.6, as does the probe.
+    struct {
+        struct io_uring_probe probe;
+        struct io_uring_probe_op ops[IORING_OP_WRITE + 1];
+    } probe;
+    memset(&probe, 0, sizeof(probe));
+    if (sys_io_uring_register(IORING_REGISTER_PROBE, &probe,
+                              IORING_OP_WRITE + 1) < 0 ||
+        probe.probe.last_op < IORING_OP_WRITE ||
+        !(probe.ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) ||
+        !(probe.ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED))
+        goto fail;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes +
+                     params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+    unsigned char *sq_ptr =
+        mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+             ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        goto fail;
+
+    unsigned char *cq_ptr = sq_ptr;
+    if (!single_mmap) {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+
+    sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        goto fail;
+
+    sq.head       = (unsigned *)(sq_ptr + params.sq_off.head);
+    sq.tail       = (unsigned *)(sq_ptr + params.sq_off.tail);
+    sq.mask       = (unsigned *)(sq_ptr + params.sq_off.ring_mask);
+    sq.array      = (unsigned *)(sq_ptr + params.sq_off.array);
+    sq.entries    = params.sq_entries;
+    sq.local_tail = *sq.tail;
+    sq.to_submit  = 0;
+
+    cq.head = (unsigned *)(cq_ptr + params.cq_off.head);
+    cq.tail = (unsigned *)(cq_ptr + params.cq_off.tail);
+    cq.mask = (unsigned *)(cq_ptr + params.cq_off.ring_mask);
+    cq.cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+
+    ring_in_fd  = in_fd;
+    ring_out_fd = out_fd;
+
+    // Keep a read in flight from now on.
+    prep_read();
+    return true;
+
+fail:
+    close(ring_fd);
+    ring_fd = -1;
+    return false;
+#else
+    (void)in_fd;
+    (void)out_fd;
+    return false;
+#endif
+}
+
+size_t uring_read_events(struct input_event *buf, size_t max) {
+    const size_t event_size = sizeof(struct input_event);
+
+    for (;;) {
+        size_t avail = (read_fill[read_cur] - read_pos) / event_size;
+        if (avail > 0) {
+            // Input is still coming: do not hold the output of the previous
+            // batch back until it runs dry. It goes out along with the read
+            // re-armed for the next batch, if any.
+            reap_completions();
+            if (!write_inflight && write_count[write_cur] > 0) {
+                prep_pending_write();
+                uring_enter(0);
+            }
+
+            size_t count = avail < max ? avail : max;
+            memcpy(buf, read_buf[read_cur] + read_pos, count * event_size);
+            read_pos += count * event_size;
+            return count;
+        }
+
+        if (read_eof)
+            return 0;
+
+        if (read_completed) {
+            read_completed = false;
+            if (read_res == -EINTR || read_res == -EAGAIN) {
+                prep_read();
+                continue;
+            }
+            if (read_res <= 0) {
+                if (read_res < 0)
+                    fprintf(stderr, "Error in io_uring read: %s\n",
+                            strerror(-read_res));
+                read_eof = true;
+                return 0;
+            }
+
+            // Switch to the freshly filled buffer and move its trailing
+            // partial event (if any) to the buffer the next read goes to.
+            read_cur            = !read_cur;
+            read_pos            = 0;
+            read_fill[read_cur] = read_carry + read_res;
+            read_carry          = read_fill[read_cur] % event_size;
+            read_fill[read_cur] -= read_carry;
+            memcpy(read_buf[!read_cur], read_buf[read_cur] + read_fill[read_cur],
+                   read_carry);
+            prep_read();
+            continue;
+        }
+
+        // Submit pending output and the read in one go, then wait.
+        prep_pending_write();
+        uring_enter(1);
+    }
+}
+
+void uring_write_events(const struct input_event *events, size_t count) {
+    while (count > 0) {
+        size_t space = URING_WRITE_BUF_EVENTS - write_count[write_cur];
+        if (space == 0) {
+            // Both buffers are busy: wait for the in-flight write.
+            while (write_inflight)
+                uring_enter(1);
+            prep_pending_write();
+            continue;
+        }
+
+        size_t n = count < space ? count : space;
+        memcpy(&write_buf[write_cur][write_count[write_cur]], events,
+               n * sizeof(*events));
+        write_count[write_cur] += n;
+        events += n;
+        count -= n;
+    }
+}
+
+void uring_drain(void) {
+    for (;;) {
+        prep_pending_write();
+        if (!write_inflight)
+            break;
+        uring_enter(1);
+    }
+}
+
+uint64_t uring_syscall_count(void) {
+    return enter_count;
+}
@@ -0,0 +1,60 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 - 2021 Andriy B. Kmit'
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// Author: Andriy B. Kmit' <dev@madand.net>
+// URL: https://github.com/madand/interception-home-row-fu
+
+/* io_uring based event I/O. Talks to the kernel through the raw syscalls, so
+ * there is no dependency on liburing. */
+
+#ifndef IO_URING_H
+#define IO_URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/input.h>  // struct input_event
+
+/* Set up the ring for reading from in_fd and writing to out_fd. Return false
+ * if io_uring is not usable (old kernel, seccomp etc.), so the caller can fall
+ * back to the plain read/write path. */
+bool uring_init(int in_fd, int out_fd);
+
+/* Read up to max whole events into buf, blocking until at least one is
+ * available. The pending output gets submitted by the same syscall, or right
+ * away if there are events to return without waiting. Return the number of
+ * events read, or 0 on EOF or error. */
+size_t uring_read_events(struct input_event *buf, size_t max);
+
+/* Queue events for writing. They are submitted by the next read, so there is no
+ * syscall per write. */
+void uring_write_events(const struct input_event *events, size_t count);
+
+/* Submit all queued output and wait until it is written. */
+void uring_drain(void);
+
+/* Number of io_uring_enter(2) calls made so far. */
+uint64_t uring_syscall_count(void);
+
+#endif /* IO_URING_H */
@@ -33,6 +33,10 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "toml.h"
 
 
@@ -53,10 +57,122 @@ void toml_set_memutil(void* (*xxmalloc)(size_t),
 }
 
 
-#define MALLOC(a)	  ppmalloc(a)
-#define FREE(a)		  ppfree(a)
-#define CALLOC(a,b)	  ppcalloc(a,b)
-#define REALLOC(a,b)  pprealloc(a,b)
+
+/*
+ *	Arena used by toml_parse_arena(). Blocks come from ppmalloc() and are
+ *	bumped through; nothing is freed until the whole document is. Every
+ *	allocation is preceded by its capacity so that REALLOC() can grow in
+ *	place or double, which keeps the arrays that grow one element at a
+ *	time linear.
+ */
+#ifndef TOML_ARENA_BLOCK_SIZE
+#define TOML_ARENA_BLOCK_SIZE 16384
+#endif
+/* Blocks double in size up to this, to bound the unused tail of the last. */
+#ifndef TOML_ARENA_MAX_BLOCK_SIZE
+#define TOML_ARENA_MAX_BLOCK_SIZE (1 << 20)
+#endif
+#define TOML_ARENA_ALIGN 16
+
+typedef struct toml_arena_block_t toml_arena_block_t;
+struct toml_arena_block_t {
+	toml_arena_block_t* prev;
+	size_t cap;				/* bytes in data[] */
+	size_t used;
+	size_t last;			/* offset of the last allocation in data[] */
+	char data[];
+};
+
+/* The arena of the document being parsed by this thread, or 0. */
+static __thread toml_arena_block_t** cur_arena;
+
+static size_t arena_round(size_t n)
+{
+	return (n + TOML_ARENA_ALIGN - 1) & ~(size_t) (TOML_ARENA_ALIGN - 1);
+}
+
+static size_t* arena_header(void* p)
+{
+	return (size_t*) ((char*) p - TOML_ARENA_ALIGN);
+}
+
+static void* arena_alloc(size_t n)
+{
+	toml_arena_block_t* b = *cur_arena;
+	size_t need = TOML_ARENA_ALIGN + arena_round(n);
+
+	if (!b || b->cap - b->used < need) {
+		size_t cap = b ? 2 * b->cap : TOML_ARENA_BLOCK_SIZE;
+		if (cap > TOML_ARENA_MAX_BLOCK_SIZE) cap = TOML_ARENA_MAX_BLOCK_SIZE;
+		if (cap < need) cap = need;
+		toml_arena_block_t* x = ppmalloc(arena_round(sizeof(*x)) + cap);
+		if (!x) return 0;
+		x->prev = b;
+		x->cap = cap;
+		x->used = arena_round(sizeof(*x)) - sizeof(*x);
+		x->last = 0;
+		*cur_arena = b = x;
+	}
+
+	b->last = b->used;
+	b->used += need;
+	char* p = b->data + b->last + TOML_ARENA_ALIGN;
+	*arena_header(p) = arena_round(n);
+	return p;
+}
+
+static void* arena_realloc(void* p, size_t n)
+{
+	if (!p) return arena_alloc(n);
+
+	size_t cap = *arena_header(p);
+	if (n <= cap) return p;
+
+	/* grow in place if p is the last allocation of the current block */
+	toml_arena_block_t* b = *cur_arena;
+	if (b->data + b->last + TOML_ARENA_ALIGN == (char*) p
+		&& b->cap - b->last - TOML_ARENA_ALIGN >= arena_round(n)) {
+		b->used = b->last + TOML_ARENA_ALIGN + arena_round(n);
+		*arena_header(p) = arena_round(n);
+		return p;
+	}
+
+	void* x = arena_alloc(n < 2 * cap ? 2 * cap : n);
+	if (x) memcpy(x, p, cap);
+	return x;
+}
+
+static void arena_release(toml_arena_block_t* b)
+{
+	while (b) {
+		toml_arena_block_t* prev = b->prev;
+		ppfree(b);
+		b = prev;
+	}
+}
+
+static void* MALLOC(size_t a)
+{
+	return cur_arena ? arena_alloc(a) : ppmalloc(a);
+}
+
+static void FREE(void* a)
+{
+	if (!cur_arena) ppfree(a);
+}
+
+static void* CALLOC(size_t a, size_t b)
+{
+	if (!cur_arena) return ppcalloc(a, b);
+	void* p = arena_alloc(a * b);
+	if (p) memset(p, 0, a * b);
+	return p;
+}
+
+static void* REALLOC(void* a, size_t b)
+{
+	return cur_arena ? arena_realloc(a, b) : pprealloc(a, b);
+}
 
 static char* STRDUP(const char* s)
 {
@@ -263,6 +379,8 @@ typedef struct toml_keyval_t toml_keyval_t;
 struct toml_keyval_t {
 	const char* key;		/* key to this value */
 	const char* val;		/* the raw value */
+	const char* src;		/* the raw value in the source (arena) or val */
+	int srclen;
 };
 
 
@@ -280,6 +398,26 @@ struct toml_array_t {
 };
 	
 
+/* Tables with at least this many keys get a hash index. Smaller ones are
+ * searched linearly, which is faster at that size. */
+#ifndef TOML_INDEX_MIN_KEYS
+#define TOML_INDEX_MIN_KEYS 16
+#endif
+
+typedef struct toml_index_slot_t toml_index_slot_t;
+struct toml_index_slot_t {
+	uint32_t hash;
+	int kind;			/* 'v'alue, 'a'rray, 't'able, or 0 if the slot is free */
+	int idx;			/* position in kval, arr or tab */
+};
+
+typedef struct toml_index_t toml_index_t;
+struct toml_index_t {
+	int cap;			/* number of slots, power of 2 */
+	int count;			/* number of slots in use */
+	toml_index_slot_t* slot;
+};
+
 struct toml_table_t {
 	const char* key;		/* key to this table */
 	bool implicit;		/* table was created implicitly */
@@ -295,9 +433,132 @@ struct toml_table_t {
 	/* tables in the table */
 	int		   ntab;
 	toml_table_t** tab;
+
+	/* hash index of all of the above, or 0 while the table is small */
+	toml_index_t* index;
+
+	/* root table of toml_parse_arena(): the arena holding the document */
+	toml_arena_block_t* arena;
+
+	/* root table of toml_parse_mmap(): the mapping of the source */
+	char* map;
+	size_t mapsize;
 };
 
 
+/* FNV-1a */
+static uint32_t hash_key(const char* key)
+{
+	uint32_t hash = 2166136261u;
+	for ( ; *key; key++) {
+		hash ^= (unsigned char) *key;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static const char* entry_key(const toml_table_t* tab, int kind, int idx)
+{
+	switch (kind) {
+	case 'v': return tab->kval[idx]->key;
+	case 'a': return tab->arr[idx]->key;
+	case 't': return tab->tab[idx]->key;
+	}
+	return 0;
+}
+
+/* Put an entry into a free slot. The index must have room for it. */
+static void index_put(toml_index_t* index, uint32_t hash, int kind, int idx)
+{
+	int mask = index->cap - 1;
+	int i = hash & mask;
+	while (index->slot[i].kind)
+		i = (i + 1) & mask;
+	index->slot[i].hash = hash;
+	index->slot[i].kind = kind;
+	index->slot[i].idx = idx;
+	index->count++;
+}
+
+static void index_free(toml_index_t* index)
+{
+	if (!index) return;
+	FREE(index->slot);
+	FREE(index);
+}
+
+/* (Re)build the index of the table with room for at least n keys. */
+static int index_build(toml_table_t* tab, int n)
+{
+	toml_index_t* index = (toml_index_t*) MALLOC(sizeof(*index));
+	if (!index) return -1;
+
+	index->cap = 2 * TOML_INDEX_MIN_KEYS;
+	while (index->cap < 2 * n)
+		index->cap *= 2;
+	index->count = 0;
+	index->slot = (toml_index_slot_t*) CALLOC(index->cap, sizeof(*index->slot));
+	if (!index->slot) {
+		FREE(index);
+		return -1;
+	}
+
+	int i;
+	for (i = 0; i < tab->nkval; i++)
+		index_put(index, hash_key(tab->kval[i]->key), 'v', i);
+	for (i = 0; i < tab->narr; i++)
+		index_put(index, hash_key(tab->arr[i]->key), 'a', i);
+	for (i = 0; i < tab->ntab; i++)
+		index_put(index, hash_key(tab->tab[i]->key), 't', i);
+
+	index_free(tab->index);
+	tab->index = index;
+	return 0;
+}
+
+/* Account for the entry just appended to the table. If memory runs out, the
+ * index is dropped and the table is searched linearly from then on. */
+static void index_add(toml_table_t* tab, int kind, int idx)
+{
+	int n = tab->nkval + tab->narr + tab->ntab;
+
+	if (!tab->index) {
+		if (n >= TOML_INDEX_MIN_KEYS)
+			index_build(tab, n);
+		return;
+	}
+
+	if (2 * n > tab->index->cap) {
+		if (index_build(tab, n)) {
+			index_free(tab->index);
+			tab->index = 0;
+		}
+		return;
+	}
+
+	index_put(tab->index, hash_key(entry_key(tab, kind, idx)), kind, idx);
+}
+
+/* Look up key in the index of tab. Return the kind of the entry and set
+ * *ret_idx, or return 0 if not found. */
+static int index_find(const toml_table_t* tab, const char* key, int* ret_idx)
+{
+	const toml_index_t* index = tab->index;
+	uint32_t hash = hash_key(key);
+	int mask = index->cap - 1;
+
+	for (int i = hash & mask; index->slot[i].kind; i = (i + 1) & mask) {
+		const toml_index_slot_t* slot = &index->slot[i];
+		if (slot->hash == hash &&
+			0 == strcmp(key, entry_key(tab, slot->kind, slot->idx))) {
+			*ret_idx = slot->idx;
+			return slot->kind;
+		}
+	}
+	return 0;
+}
+
+
 static inline void xfree(const void* x) { if (x) FREE((void*)(intptr_t)x); }
 
 
@@ -636,6 +897,15 @@ static int check_key(toml_table_t* tab, const char* key,
 	if (!ret_val) ret_val = (toml_keyval_t**) &dummy;
 
 	*ret_tab = 0; *ret_arr = 0; *ret_val = 0;
+
+	if (tab->index) {
+		switch (index_find(tab, key, &i)) {
+		case 'v': *ret_val = tab->kval[i]; return 'v';
+		case 'a': *ret_arr = tab->arr[i]; return 'a';
+		case 't': *ret_tab = tab->tab[i]; return 't';
+		}
+		return 0;
+	}
 	
 	for (i = 0; i < tab->nkval; i++) {
 		if (0 == strcmp(key, tab->kval[i]->key)) {
@@ -701,6 +971,7 @@ static toml_keyval_t* create_keyval_in_table(context_t* ctx, toml_table_t* tab,
 
 	/* save the key in the new value struct */
 	dest->key = newkey;
+	index_add(tab, 'v', tab->nkval - 1);
 	return dest;
 }
 
@@ -749,6 +1020,7 @@ static toml_table_t* create_keytable_in_table(context_t* ctx, toml_table_t* tab,
 	
 	/* save the key in the new table struct */
 	dest->key = newkey;
+	index_add(tab, 't', tab->ntab - 1);
 	return dest;
 }
 
@@ -793,6 +1065,7 @@ static toml_array_t* create_keyarray_in_table(context_t* ctx,
 	/* save the key in the new array struct */
 	dest->key = newkey;
 	dest->kind = kind;
+	index_add(tab, 'a', tab->narr - 1);
 	return dest;
 }
 
@@ -1061,6 +1334,8 @@ static int parse_keyval(context_t* ctx, toml_table_t* tab)
 			assert(keyval->val == 0);
 			if (! (keyval->val = STRNDUP(val.ptr, val.len))) 
 				return e_outofmemory(ctx, FLINE);
+			keyval->src = cur_arena ? val.ptr : keyval->val;
+			keyval->srclen = val.len;
 
 			if (next_token(ctx, 1)) return -1;
 		
@@ -1192,6 +1467,7 @@ static int walk_tabpath(context_t* ctx)
 					return e_outofmemory(ctx, FLINE);
 		
 				nexttab = curtab->tab[curtab->ntab++];
+				index_add(curtab, 't', curtab->ntab - 1);
 		
 				/* tabs created by walk_tabpath are considered implicit */
 				nexttab->implicit = true;
@@ -1377,6 +1653,86 @@ fail:
 }
 
 
+toml_table_t* toml_parse_arena(char* conf,
+							   char* errbuf,
+							   int errbufsz)
+{
+	toml_arena_block_t* arena = 0;
+
+	cur_arena = &arena;
+	toml_table_t* ret = toml_parse(conf, errbuf, errbufsz);
+	cur_arena = 0;
+
+	if (ret)
+		ret->arena = arena;
+	else
+		arena_release(arena);
+	return ret;
+}
+
+
+static size_t map_size(size_t size)
+{
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	return (size / pagesize + 1) * pagesize;
+}
+
+
+char* toml_map_file(int fd, size_t* size)
+{
+	struct stat st;
+	if (fstat(fd, &st)) return 0;
+	if (! S_ISREG(st.st_mode)) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	/* Reserve a zero page past the end of the file, so that the mapping is
+	 * NUL terminated even when the file fills its last page. */
+	*size = st.st_size;
+	char* map = mmap(0, map_size(*size), PROT_READ,
+					 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) return 0;
+
+	if (*size > 0
+		&& mmap(map, *size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		int err = errno;
+		munmap(map, map_size(*size));
+		errno = err;
+		return 0;
+	}
+	return map;
+}
+
+
+void toml_unmap_file(char* map, size_t size)
+{
+	if (map) munmap(map, map_size(size));
+}
+
+
+toml_table_t* toml_parse_mmap(int fd,
+							  char* errbuf,
+							  int errbufsz)
+{
+	size_t size;
+	char* map = toml_map_file(fd, &size);
+	if (!map) {
+		snprintf(errbuf, errbufsz, "%s", strerror(errno));
+		return 0;
+	}
+
+	toml_table_t* ret = toml_parse_arena(map, errbuf, errbufsz);
+	if (!ret) {
+		toml_unmap_file(map, size);
+		return 0;
+	}
+	ret->map = map;
+	ret->mapsize = size;
+	return ret;
+}
+
+
 toml_table_t* toml_parse_file(FILE* fp,
 							  char* errbuf,
 							  int errbufsz)
@@ -1426,6 +1782,354 @@ toml_table_t* toml_parse_file(FILE* fp,
 }
 
 
+/*
+ *	Streaming parser. It drives the same tokenizer as toml_parse(), but
+ *	hands every key/value to a callback instead of building tables. The
+ *	keys of the current path live in a fixed buffer, so apart from quoted
+ *	keys nothing is allocated.
+ */
+#ifndef TOML_STREAM_MAX_DEPTH
+#define TOML_STREAM_MAX_DEPTH 16
+#endif
+#define TOML_STREAM_PATH_SIZE 1024
+
+typedef struct stream_t stream_t;
+struct stream_t {
+	context_t ctx;
+	const toml_stream_t* cb;
+	int rc;					/* non-zero value returned by a callback */
+
+	int depth;
+	const char* path[TOML_STREAM_MAX_DEPTH];
+	char buf[TOML_STREAM_PATH_SIZE];
+};
+
+/* Append the key of keytok to the path. */
+static int stream_push(stream_t* s, token_t keytok)
+{
+	context_t* ctx = &s->ctx;
+	const char* key = keytok.ptr;
+	int len = keytok.len;
+	char* norm = 0;
+
+	if (s->depth >= TOML_STREAM_MAX_DEPTH)
+		return e_syntax(ctx, keytok.lineno, "key path is too deep");
+
+	if (*key == '\'' || *key == '"') {
+		if (! (norm = normalize_key(ctx, keytok))) return -1;
+		key = norm;
+		len = strlen(norm);
+	} else {
+		/* for bare-key allow only this regex: [A-Za-z0-9_-]+ */
+		for (int i = 0; i < len; i++) {
+			int k = key[i];
+			if (! (isalnum(k) || k == '_' || k == '-'))
+				return e_badkey(ctx, keytok.lineno);
+		}
+	}
+
+	char* p = s->depth ? strchr(s->path[s->depth-1], 0) + 1 : s->buf;
+	if (len >= s->buf + sizeof(s->buf) - p) {
+		xfree(norm);
+		return e_syntax(ctx, keytok.lineno, "key path is too long");
+	}
+	memcpy(p, key, len);
+	p[len] = 0;
+	s->path[s->depth++] = p;
+	xfree(norm);
+	return 0;
+}
+
+static int stream_keyval(stream_t* s);
+
+/* We are at '{ ... }'. Report its key/values under the current path. */
+static int stream_table(stream_t* s)
+{
+	context_t* ctx = &s->ctx;
+
+	if (eat_token(ctx, LBRACE, 1, FLINE))
+		return -1;
+
+	for (;;) {
+		if (ctx->tok.tok == NEWLINE) 
+			return e_syntax(ctx, ctx->tok.lineno, "newline not allowed in inline table");
+
+		/* until } */
+		if (ctx->tok.tok == RBRACE)
+			break;
+
+		if (ctx->tok.tok != STRING) 
+			return e_syntax(ctx, ctx->tok.lineno, "expect a string");
+
+		if (stream_keyval(s))
+			return -1;
+		
+		if (ctx->tok.tok == NEWLINE) 
+			return e_syntax(ctx, ctx->tok.lineno, "newline not allowed in inline table");
+
+		/* on comma, continue to scan for next keyval */
+		if (ctx->tok.tok == COMMA) {
+			if (eat_token(ctx, COMMA, 1, FLINE))
+				return -1;
+			continue;
+		}
+		break;
+	}
+
+	if (eat_token(ctx, RBRACE, 1, FLINE))
+		return -1;
+	return 0;
+}
+
+/* We are at '[ ... ]'. Skip to its end and set *len to its length. */
+static int stream_skip_array(stream_t* s, int* len)
+{
+	context_t* ctx = &s->ctx;
+	const char* start = ctx->tok.ptr;
+	int level = 0;
+
+	for (;;) {
+		if (ctx->tok.eof)
+			return e_syntax(ctx, ctx->tok.lineno, "unterminated array");
+
+		switch (ctx->tok.tok) {
+		case LBRACKET: case LBRACE:
+			level++;
+			break;
+		case RBRACKET: case RBRACE:
+			level--;
+			break;
+		default:
+			break;
+		}
+
+		if (level == 0) {
+			*len = ctx->tok.ptr + 1 - start;
+			return next_token(ctx, 1);
+		}
+		if (next_token(ctx, 0)) return -1;
+	}
+}
+
+/* Return true if the '[ ... ]' we are at is an array of inline tables. */
+static int stream_at_table_array(stream_t* s)
+{
+	context_t* ctx = &s->ctx;
+	for (const char* p = ctx->tok.ptr + 1; p < ctx->stop; p++) {
+		if (*p == '#')
+			for (p++; p < ctx->stop && *p != '\n'; p++);
+		else if (! strchr(" \t\r\n", *p))
+			return *p == '{';
+	}
+	return 0;
+}
+
+/* We are at '[ {table}, {table} ... ]'. Report each table like an [[array]]
+ * header at the current path, followed by its key/values. */
+static int stream_table_array(stream_t* s)
+{
+	context_t* ctx = &s->ctx;
+	int depth = s->depth;
+
+	if (eat_token(ctx, LBRACKET, 0, FLINE)) return -1;
+
+	for (;;) {
+		if (skip_newlines(ctx, 0)) return -1;
+
+		/* until ] */
+		if (ctx->tok.tok == RBRACKET) break;
+
+		if (ctx->tok.tok != LBRACE)
+			return e_syntax(ctx, ctx->tok.lineno,
+							"array type mismatch while processing array of tables");
+
+		if (s->cb->table) {
+			s->rc = s->cb->table(s->cb->arg, s->path, s->depth, 1);
+			if (s->rc) return -1;
+		}
+		if (stream_table(s)) return -1;
+		s->depth = depth;
+
+		if (skip_newlines(ctx, 0)) return -1;
+
+		/* on comma, continue to scan for next element */
+		if (ctx->tok.tok == COMMA) {
+			if (eat_token(ctx, COMMA, 0, FLINE)) return -1;
+			continue;
+		}
+		break;
+	}
+
+	if (eat_token(ctx, RBRACKET, 1, FLINE)) return -1;
+	return 0;
+}
+
+/* handle lines like these:
+   key = "value"
+   key = [ array ]
+   key = { table }
+   key.subkey = "value"
+*/
+static int stream_keyval(stream_t* s)
+{
+	context_t* ctx = &s->ctx;
+	int depth = s->depth;
+
+	for (;;) {
+		if (stream_push(s, ctx->tok)) return -1;
+		if (eat_token(ctx, STRING, 1, FLINE)) return -1;
+		if (ctx->tok.tok != DOT) break;
+
+		if (next_token(ctx, 1)) return -1;
+		if (ctx->tok.tok != STRING)
+			return e_syntax(ctx, ctx->tok.lineno, "invalid key");
+	}
+
+	if (ctx->tok.tok != EQUAL) {
+		return e_syntax(ctx, ctx->tok.lineno, "missing =");
+	}
+
+	if (next_token(ctx, 0)) return -1;
+
+	token_t val = ctx->tok;
+	switch (val.tok) {
+	case STRING:
+		if (next_token(ctx, 1)) return -1;
+		break;
+
+	case LBRACKET:
+		if (stream_at_table_array(s)) {
+			if (stream_table_array(s)) return -1;
+			s->depth = depth;
+			return 0;
+		}
+		if (stream_skip_array(s, &val.len)) return -1;
+		break;
+
+	case LBRACE:
+		if (stream_table(s)) return -1;
+		s->depth = depth;
+		return 0;
+
+	default:
+		return e_syntax(ctx, ctx->tok.lineno, "syntax error");
+	}
+
+	if (s->cb->keyval) {
+		s->rc = s->cb->keyval(s->cb->arg, s->path, s->depth - 1,
+							  s->path[s->depth - 1], val.ptr, val.len);
+		if (s->rc) return -1;
+	}
+	s->depth = depth;
+	return 0;
+}
+
+/* handle lines like [x.y.z] or [[x.y.z]] */
+static int stream_select(stream_t* s)
+{
+	context_t* ctx = &s->ctx;
+	int lineno = ctx->tok.lineno;
+
+	/* true if [[ */
+	int llb = (ctx->tok.ptr + 1 < ctx->stop && ctx->tok.ptr[1] == '[');
+
+	/* eat [ or [[ */
+	if (eat_token(ctx, LBRACKET, 1, FLINE)) return -1;
+	if (llb) {
+		if (eat_token(ctx, LBRACKET, 1, FLINE)) return -1;
+	}
+
+	s->depth = 0;
+	for (;;) {
+		if (ctx->tok.tok != STRING) 
+			return e_syntax(ctx, lineno, "invalid or missing key");
+		if (stream_push(s, ctx->tok)) return -1;
+		if (next_token(ctx, 1)) return -1;
+
+		if (ctx->tok.tok == RBRACKET) break;
+
+		if (ctx->tok.tok != DOT) 
+			return e_syntax(ctx, lineno, "invalid key");
+
+		if (next_token(ctx, 1)) return -1;
+	}
+
+	if (llb) {
+		if (! (ctx->tok.ptr + 1 < ctx->stop && ctx->tok.ptr[1] == ']')) {
+			return e_syntax(ctx, ctx->tok.lineno, "expects ]]");
+		}
+		if (eat_token(ctx, RBRACKET, 1, FLINE)) return -1;
+	}
+	
+	if (eat_token(ctx, RBRACKET, 1, FLINE))
+		return -1;
+	
+	if (ctx->tok.tok != NEWLINE) 
+		return e_syntax(ctx, ctx->tok.lineno, "extra chars after ] or ]]");
+
+	if (s->cb->table) {
+		s->rc = s->cb->table(s->cb->arg, s->path, s->depth, llb);
+		if (s->rc) return -1;
+	}
+	return 0;
+}
+
+
+int toml_parse_stream(char* conf,
+					  const toml_stream_t* cb,
+					  char* errbuf,
+					  int errbufsz)
+{
+	stream_t s;
+
+	// clear errbuf 
+	if (errbufsz <= 0) errbufsz = 0;
+	if (errbufsz > 0)  errbuf[0] = 0;
+
+	// init context 
+	memset(&s, 0, offsetof(stream_t, buf));
+	s.cb = cb;
+	s.ctx.start = conf;
+	s.ctx.stop = s.ctx.start + strlen(conf);
+	s.ctx.errbuf = errbuf;
+	s.ctx.errbufsz = errbufsz;
+
+	// start with an artificial newline of length 0
+	s.ctx.tok.tok = NEWLINE; 
+	s.ctx.tok.lineno = 1;
+	s.ctx.tok.ptr = conf;
+	s.ctx.tok.len = 0;
+
+	/* Scan forward until EOF */
+	for (token_t tok = s.ctx.tok; ! tok.eof ; tok = s.ctx.tok) {
+		switch (tok.tok) {
+		
+		case NEWLINE:
+			if (next_token(&s.ctx, 1)) return -1;
+			break;
+		
+		case STRING:
+			if (stream_keyval(&s)) return s.rc ? s.rc : -1;
+			
+			if (s.ctx.tok.tok != NEWLINE) 
+				return e_syntax(&s.ctx, s.ctx.tok.lineno, "extra chars after value");
+
+			if (eat_token(&s.ctx, NEWLINE, 1, FLINE)) return -1;
+			break;
+		
+		case LBRACKET:	/* [ x.y.z ] or [[ x.y.z ]] */
+			if (stream_select(&s)) return s.rc ? s.rc : -1;
+			break;
+		
+		default:
+			return e_syntax(&s.ctx, tok.lineno, "syntax error");
+		}
+	}
+
+	return 0;
+}
+
+
 static void xfree_kval(toml_keyval_t* p)
 {
 	if (!p) return;
@@ -1479,13 +2183,20 @@ static void xfree_tab(toml_table_t* p)
 	for (i = 0; i < p->ntab; i++) xfree_tab(p->tab[i]);
 	xfree(p->tab);
 
+	index_free(p->index);
 	xfree(p);
 }
 
 
 void toml_free(toml_table_t* tab)
 {
-	xfree_tab(tab);
+	if (tab && tab->arena) {
+		char* map = tab->map;
+		size_t mapsize = tab->mapsize;
+		arena_release(tab->arena);
+		toml_unmap_file(map, mapsize);
+	} else
+		xfree_tab(tab);
 }
 
 
@@ -1711,6 +2422,8 @@ const char* toml_key_in(const toml_table_t* tab, int keyidx)
 toml_raw_t toml_raw_in(const toml_table_t* tab, const char* key)
 {
 	int i;
+	if (tab->index)
+		return index_find(tab, key, &i) == 'v' ? tab->kval[i]->val : 0;
 	for (i = 0; i < tab->nkval; i++) {
 		if (0 == strcmp(key, tab->kval[i]->key))
 			return tab->kval[i]->val;
@@ -1718,9 +2431,29 @@ toml_raw_t toml_raw_in(const toml_table_t* tab, const char* key)
 	return 0;
 }
 
+int toml_raw_view_in(const toml_table_t* tab, const char* key,
+					 const char** ret, int* retlen)
+{
+	int i;
+	if (tab->index) {
+		if (index_find(tab, key, &i) != 'v') return -1;
+	} else {
+		for (i = 0; i < tab->nkval; i++) {
+			if (0 == strcmp(key, tab->kval[i]->key))
+				break;
+		}
+		if (i == tab->nkval) return -1;
+	}
+	*ret = tab->kval[i]->src;
+	*retlen = tab->kval[i]->srclen;
+	return 0;
+}
+
 toml_array_t* toml_array_in(const toml_table_t* tab, const char* key)
 {
 	int i;
+	if (tab->index)
+		return index_find(tab, key, &i) == 'a' ? tab->arr[i] : 0;
 	for (i = 0; i < tab->narr; i++) {
 		if (0 == strcmp(key, tab->arr[i]->key))
 			return tab->arr[i];
@@ -1732,6 +2465,8 @@ toml_array_t* toml_array_in(const toml_table_t* tab, const char* key)
 toml_table_t* toml_table_in(const toml_table_t* tab, const char* key)
 {
 	int i;
+	if (tab->index)
+		return index_find(tab, key, &i) == 't' ? tab->tab[i] : 0;
 	for (i = 0; i < tab->ntab; i++) {
 		if (0 == strcmp(key, tab->tab[i]->key))
 			return tab->tab[i];
@@ -2111,3 +2846,25 @@ int toml_rtos(toml_raw_t src, char** ret)
 	
 	return *ret ? 0 : -1;
 }
+
+
+int toml_vtos(const char* src, int srclen, const char** ret, int* retlen)
+{
+	if (srclen < 2) return -1;
+
+	int qchar = src[0];
+	if (! (qchar == '\'' || qchar == '"') || src[srclen-1] != qchar)
+		return -1;
+
+	/* triple quotes need the newline handling of toml_rtos() */
+	if (srclen >= 3 && src[1] == qchar && src[2] == qchar)
+		return -1;
+
+	/* so do escapes */
+	if (qchar == '"' && memchr(src, '\\', srclen))
+		return -1;
+
+	*ret = src + 1;
+	*retlen = srclen - 2;
+	return 0;
+}
@@ -57,7 +57,63 @@ TOML_EXTERN toml_table_t* toml_parse(char* conf, /* NUL terminated, please. */
 									 char* errbuf,
 									 int errbufsz);
 
-/* Free the table returned by toml_parse() or toml_parse_file(). */
+/* Parse like toml_parse(), but draw all the memory of the document from a
+ * single arena, which toml_free() releases in one go. The views returned by
+ * toml_raw_view_in() point into conf, so it must outlive the table.
+ */
+TOML_EXTERN toml_table_t* toml_parse_arena(char* conf, /* NUL terminated, please. */
+										   char* errbuf,
+										   int errbufsz);
+
+/* Parse a regular file in place, from a read-only mapping of it rather
+ * than a copy on the heap. Otherwise like toml_parse_arena(); toml_free()
+ * also unmaps the file. The file must not shrink while the table is alive.
+ */
+TOML_EXTERN toml_table_t* toml_parse_mmap(int fd,
+										  char* errbuf,
+										  int errbufsz);
+
+/* Map a regular file read-only and NUL terminated, for toml_parse_arena().
+ * Set *size to the size of the file. Return 0 with errno set on failure.
+ * The mapping is released by toml_unmap_file(map, size). The file must not
+ * shrink while it is mapped: touching the pages past its end raises SIGBUS.
+ */
+TOML_EXTERN char* toml_map_file(int fd, size_t* size);
+TOML_EXTERN void toml_unmap_file(char* map, size_t size);
+
+/* Callbacks of toml_parse_stream(). path[0] .. path[depth-1] are the keys
+ * of the enclosing table, outermost first; dotted keys and inline tables
+ * extend it. Either callback may be 0. Return 0 to go on, or any other
+ * value to stop the parse and make toml_parse_stream() return it.
+ */
+typedef struct toml_stream_t toml_stream_t;
+struct toml_stream_t {
+	/* a [table] header, or an [[array]] of tables one if array is set */
+	int (*table)(void* arg, const char* const* path, int depth, int array);
+
+	/* key = value. The raw value points into conf and is not NUL
+	 * terminated. Arrays come as one raw value covering their brackets,
+	 * except arrays of inline tables: each of those is reported like an
+	 * [[array]] header at the path of the key, followed by its key/values. */
+	int (*keyval)(void* arg, const char* const* path, int depth,
+				  const char* key, const char* raw, int rawlen);
+
+	void* arg;
+};
+
+/* Parse a string containing the full config, calling back for every table
+ * header and key/value instead of building tables. Keys that are defined
+ * twice are reported twice rather than rejected.
+ * Return 0 on success, -1 on a syntax error (see errbuf), or the value
+ * returned by a callback.
+ */
+TOML_EXTERN int toml_parse_stream(char* conf, /* NUL terminated, please. */
+								  const toml_stream_t* cb,
+								  char* errbuf,
+								  int errbufsz);
+
+/* Free the table returned by toml_parse(), toml_parse_arena(),
+ * toml_parse_mmap() or toml_parse_file(). */
 TOML_EXTERN void toml_free(toml_table_t* tab);
 
 /* Retrieve the key in table at keyidx. Return 0 if out of range. */
@@ -67,6 +123,14 @@ TOML_EXTERN const char* toml_key_in(const toml_table_t* tab, int keyidx);
 TOML_EXTERN toml_raw_t toml_raw_in(const toml_table_t* tab, const char* key);
 TOML_EXTERN toml_array_t* toml_array_in(const toml_table_t* tab,
 										const char* key);
+
+/* Lookup a raw value by key without a copy: set *ret to its start and
+ * *retlen to its length. The value is not NUL terminated. For a table from
+ * toml_parse_arena() it points into the source buffer.
+ * Return 0 on success, -1 if not found.
+ */
+TOML_EXTERN int toml_raw_view_in(const toml_table_t* tab, const char* key,
+								 const char** ret, int* retlen);
 TOML_EXTERN toml_table_t* toml_table_in(const toml_table_t* tab,
 										const char* key);
 
@@ -108,6 +172,14 @@ TOML_EXTERN toml_table_t* toml_table_at(const toml_array_t* arr, int idx);
  */
 TOML_EXTERN int toml_rtos(toml_raw_t s, char** ret);
 
+/* Raw view to String, without a copy, for strings that need no unescaping:
+ * literal strings and basic strings without backslashes, on a single line.
+ * Set *ret and *retlen to the characters between the quotes.
+ * Return 0 on success, -1 otherwise (toml_rtos() handles the rest).
+ */
+TOML_EXTERN int toml_vtos(const char* src, int srclen,
+						  const char** ret, int* retlen);
+
 /* Raw to Boolean. Return 0 on success, -1 otherwise. */
 TOML_EXTERN int toml_rtob(toml_raw_t s, int* ret);
 
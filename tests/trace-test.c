@@ -0,0 +1,511 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 - 2021 Andriy B. Kmit'
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// Author: Andriy B. Kmit' <dev@madand.net>
+// URL: https://github.com/madand/interception-home-row-fu
+
+/* Trace tests: run short synthetic traces through home-row-fu and check the
+ * keys it sends.
+ *
+ * Usage: tests/trace-test PLUGIN
+ *
+ * Every case writes its configuration to a temporary file and runs
+ * PLUGIN -c FILE with its trace on STDIN. The key events coming out, in order,
+ * must be the expected ones; all the other events are left out of the
+ * comparison, except the SYN_REPORT events in the cases checking the frames. */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <linux/input.h>
+
+typedef struct input_event input_event;
+
+#define MAX_EVENTS 4096
+#define US_PER_MS 1000
+/* Delay and interval of the autorepeat of the keyboard in the traces. */
+#define AUTOREPEAT_DELAY_MSEC 250
+#define AUTOREPEAT_INTERVAL_MSEC 40
+/* Pointer events while a key is held, every this many milliseconds. */
+#define POINTER_INTERVAL_MSEC 50
+
+/* Settings of all the cases, with the key repeat on. */
+#define BASE_CONFIG                                                            \
+    "burst_typing_msec = 200\n"                                                \
+    "can_insert_letter_msec = 700\n"                                           \
+    "key_repeat_delay_msec = 200\n"                                            \
+    "key_repeat_interval_msec = 33\n"                                          \
+    "[[mapping]]\n"                                                            \
+    "physical_key = \"KEY_D\"\n"                                               \
+    "modifier_key = \"KEY_LEFTMETA\"\n"                                        \
+    "[[mapping]]\n"                                                            \
+    "physical_key = \"KEY_F\"\n"                                               \
+    "modifier_key = \"KEY_LEFTCTRL\"\n"                                        \
+    "immediately_send_modifier = true\n"
+
+struct key_event {
+    uint16_t code;
+    int32_t value;
+};
+
+/* A SYN_REPORT, in the expected events of the cases checking the frames. No key
+ * has this code. */
+#define SYN {KEY_CNT, 0}
+
+/* Trace being built, and its clock. */
+static input_event trace[MAX_EVENTS];
+static size_t trace_size;
+static struct timeval trace_time;
+
+static void append_event(uint16_t type, uint16_t code, int32_t value) {
+    if (trace_size == MAX_EVENTS) {
+        fprintf(stderr, "The trace is too long!\n");
+        exit(EXIT_FAILURE);
+    }
+    trace[trace_size++] = (input_event){
+        .time = trace_time, .type = type, .code = code, .value = value};
+}
+
+static void advance_msec(int msec) {
+    int64_t usec = trace_time.tv_usec + (int64_t)msec * US_PER_MS;
+    trace_time.tv_sec += usec / 1000000;
+    trace_time.tv_usec = usec % 1000000;
+}
+
+/* Append a frame of a key event, as the keyboard sends it. */
+static void append_key(uint16_t code, int32_t value) {
+    append_event(EV_MSC, MSC_SCAN, code);
+    append_event(EV_KEY, code, value);
+    append_event(EV_SYN, SYN_REPORT, 0);
+}
+
+/* Hold the key for msec, with the autorepeat events of the keyboard, and with
+ * pointer events of the given type and code if type is not 0. */
+static void hold_key(uint16_t code, int msec, uint16_t pointer_type,
+                     uint16_t pointer_code) {
+    append_key(code, 1);
+    for (int t = 1; t < msec; t++) {
+        advance_msec(1);
+        if (t >= AUTOREPEAT_DELAY_MSEC &&
+            (t - AUTOREPEAT_DELAY_MSEC) % AUTOREPEAT_INTERVAL_MSEC == 0)
+            append_key(code, 2);
+        if (pointer_type != 0 && t % POINTER_INTERVAL_MSEC == 0) {
+            append_event(pointer_type, pointer_code, 1);
+            append_event(EV_SYN, SYN_REPORT, 0);
+        }
+    }
+    advance_msec(1);
+    append_key(code, 0);
+}
+
+static void immediate_modifier_held_alone(void) {
+    hold_key(KEY_F, 1500, 0, 0);
+}
+
+static void immediate_modifier_held_while_scrolling(void) {
+    hold_key(KEY_F, 1500, EV_REL, REL_WHEEL);
+}
+
+static void key_held_while_pointer_moves(void) {
+    hold_key(KEY_D, 1500, EV_REL, REL_X);
+}
+
+static void key_held_alone(void) {
+    hold_key(KEY_D, 1000, 0, 0);
+}
+
+/* Another key pressed and released within the burst typing window. */
+static void quick_chord(void) {
+    append_key(KEY_D, 1);
+    advance_msec(50);
+    append_key(KEY_X, 1);
+    advance_msec(50);
+    append_key(KEY_X, 0);
+    advance_msec(50);
+    append_key(KEY_D, 0);
+}
+
+/* The key released first, within the burst typing window. */
+static void quick_roll(void) {
+    append_key(KEY_D, 1);
+    advance_msec(50);
+    append_key(KEY_X, 1);
+    advance_msec(50);
+    append_key(KEY_D, 0);
+    advance_msec(50);
+    append_key(KEY_X, 0);
+}
+
+/* Another key pressed past the burst typing window, and released first. */
+static void slow_chord(uint16_t code) {
+    append_key(KEY_D, 1);
+    advance_msec(250);
+    append_key(code, 1);
+    advance_msec(50);
+    append_key(code, 0);
+    advance_msec(50);
+    append_key(KEY_D, 0);
+}
+
+static void slow_chord_same_hand(void) {
+    slow_chord(KEY_S);
+}
+
+static void slow_chord_other_hand(void) {
+    slow_chord(KEY_J);
+}
+
+static void tap(void) {
+    append_key(KEY_D, 1);
+    advance_msec(50);
+    append_key(KEY_D, 0);
+}
+
+/* The real Ctrl pressed and released while the key is held as Ctrl. */
+static void real_modifier_released_first(void) {
+    append_key(KEY_F, 1);
+    advance_msec(300);
+    append_key(KEY_LEFTCTRL, 1);
+    advance_msec(100);
+    append_key(KEY_LEFTCTRL, 0);
+    advance_msec(500);
+    append_key(KEY_F, 0);
+}
+
+/* The key tapped while the real Ctrl is held. */
+static void tap_with_real_modifier(void) {
+    append_key(KEY_LEFTCTRL, 1);
+    advance_msec(50);
+    append_key(KEY_F, 1);
+    advance_msec(50);
+    append_key(KEY_F, 0);
+    advance_msec(50);
+    append_key(KEY_LEFTCTRL, 0);
+}
+
+/* A slow chord msec after a key typed before. */
+static void slow_chord_after_key(int msec) {
+    append_key(KEY_X, 1);
+    advance_msec(30);
+    append_key(KEY_X, 0);
+    advance_msec(msec - 30);
+    slow_chord(KEY_J);
+}
+
+static void slow_chord_in_streak(void) {
+    slow_chord_after_key(50);
+}
+
+static void slow_chord_after_pause(void) {
+    slow_chord_after_key(150);
+}
+
+/* The key released first, past the burst typing window. */
+static void slow_roll(void) {
+    append_key(KEY_D, 1);
+    advance_msec(50);
+    append_key(KEY_X, 1);
+    advance_msec(200);
+    append_key(KEY_D, 0);
+    advance_msec(50);
+    append_key(KEY_X, 0);
+}
+
+#define END {0, -1}
+
+static const struct test_case {
+    const char *name;
+    const char *config;
+    void (*build_trace)(void);
+    struct key_event expected[16];
+    /* Whether the SYN_REPORT events are compared too. */
+    bool is_framed;
+} test_cases[] = {
+    {"immediate-modifier key held alone past the repeat delay emits no letter",
+     BASE_CONFIG,
+     immediate_modifier_held_alone,
+     {{KEY_LEFTCTRL, 1}, {KEY_LEFTCTRL, 0}, END},
+     false},
+    {"immediate-modifier key held while scrolling emits no letter",
+     BASE_CONFIG,
+     immediate_modifier_held_while_scrolling,
+     {{KEY_LEFTCTRL, 1}, {KEY_LEFTCTRL, 0}, END},
+     false},
+    {"key held while the pointer moves emits no letter",
+     BASE_CONFIG,
+     key_held_while_pointer_moves,
+     {END},
+     false},
+    // The repeat starts at 930 msec, the first autorepeat event past 900, and
+    // the next one is at 970.
+    {"key held alone past the repeat delay repeats its letter",
+     BASE_CONFIG,
+     key_held_alone,
+     {{KEY_D, 1}, {KEY_D, 0}, {KEY_D, 1}, {KEY_D, 0}, END},
+     false},
+    // The frames held back while the key decides come out whole, after the
+    // one of the modifier. The events sent for a mapped key come with their
+    // own SYN_REPORT, before the one of their input frame.
+    {"permissive-hold: quick chord sends the modifier, frame by frame",
+     "hold_tap_policy = \"permissive-hold\"\n" BASE_CONFIG,
+     quick_chord,
+     {SYN, {KEY_LEFTMETA, 1}, SYN, {KEY_X, 1}, SYN, {KEY_X, 0}, SYN,
+      {KEY_LEFTMETA, 0}, SYN, SYN, END},
+     true},
+    {"permissive-hold: quick roll sends the letters, frame by frame",
+     "hold_tap_policy = \"permissive-hold\"\n" BASE_CONFIG,
+     quick_roll,
+     {SYN, {KEY_D, 1}, SYN, {KEY_X, 1}, SYN, {KEY_D, 0}, SYN, SYN, {KEY_X, 0},
+      SYN, END},
+     true},
+    {"permissive-hold: slow roll sends the letters",
+     "hold_tap_policy = \"permissive-hold\"\n" BASE_CONFIG,
+     slow_roll,
+     {{KEY_D, 1}, {KEY_X, 1}, {KEY_D, 0}, {KEY_X, 0}, END},
+     false},
+    {"balanced: quick chord sends the modifier, frame by frame",
+     "hold_tap_policy = \"balanced\"\n" BASE_CONFIG,
+     quick_chord,
+     {SYN, {KEY_LEFTMETA, 1}, SYN, {KEY_X, 1}, SYN, {KEY_X, 0}, SYN,
+      {KEY_LEFTMETA, 0}, SYN, SYN, END},
+     true},
+    {"balanced: quick roll sends the letters",
+     "hold_tap_policy = \"balanced\"\n" BASE_CONFIG,
+     quick_roll,
+     {{KEY_D, 1}, {KEY_X, 1}, {KEY_D, 0}, {KEY_X, 0}, END},
+     false},
+    {"balanced: slow roll sends the modifier",
+     "hold_tap_policy = \"balanced\"\n" BASE_CONFIG,
+     slow_roll,
+     {{KEY_LEFTMETA, 1}, {KEY_X, 1}, {KEY_LEFTMETA, 0}, {KEY_X, 0}, END},
+     false},
+    {"hold-on-other-key-press: quick roll sends the modifier",
+     "hold_tap_policy = \"hold-on-other-key-press\"\n" BASE_CONFIG,
+     quick_roll,
+     {{KEY_LEFTMETA, 1}, {KEY_X, 1}, {KEY_LEFTMETA, 0}, {KEY_X, 0}, END},
+     false},
+    {"bilateral combinations: key of the same hand sends the letters",
+     "bilateral_combinations = true\n" BASE_CONFIG,
+     slow_chord_same_hand,
+     {{KEY_D, 1}, {KEY_S, 1}, {KEY_S, 0}, {KEY_D, 0}, END},
+     false},
+    {"bilateral combinations: key of the other hand sends the modifier",
+     "bilateral_combinations = true\n" BASE_CONFIG,
+     slow_chord_other_hand,
+     {{KEY_LEFTMETA, 1}, {KEY_J, 1}, {KEY_J, 0}, {KEY_LEFTMETA, 0}, END},
+     false},
+    {"typing streak: key pressed soon after another sends its letter",
+     "require_prior_idle_msec = 100\n" BASE_CONFIG,
+     slow_chord_in_streak,
+     {{KEY_X, 1}, {KEY_X, 0}, {KEY_D, 1}, {KEY_J, 1}, {KEY_J, 0}, {KEY_D, 0},
+      END},
+     false},
+    {"typing streak: key pressed after a pause sends the modifier",
+     "require_prior_idle_msec = 100\n" BASE_CONFIG,
+     slow_chord_after_pause,
+     {{KEY_X, 1}, {KEY_X, 0}, {KEY_LEFTMETA, 1}, {KEY_J, 1}, {KEY_J, 0},
+      {KEY_LEFTMETA, 0}, END},
+     false},
+    // The letter comes out in the frame of the Key Down, the one of the Key Up
+    // is empty.
+    {"speculative letters: tap sends the letter at once",
+     "speculative_letters = true\n" BASE_CONFIG,
+     tap,
+     {{KEY_D, 1}, SYN, {KEY_D, 0}, SYN, SYN, SYN, END},
+     true},
+    {"speculative letters: modifier takes the letter back first",
+     "speculative_letters = true\n"
+     "correction_key = \"KEY_DELETE\"\n" BASE_CONFIG,
+     slow_chord_other_hand,
+     {{KEY_D, 1}, {KEY_D, 0}, {KEY_DELETE, 1}, {KEY_DELETE, 0},
+      {KEY_LEFTMETA, 1}, {KEY_J, 1}, {KEY_J, 0}, {KEY_LEFTMETA, 0}, END},
+     false},
+    {"real modifier released before the emulating key stays down until then",
+     BASE_CONFIG,
+     real_modifier_released_first,
+     {{KEY_LEFTCTRL, 1}, {KEY_LEFTCTRL, 0}, END},
+     false},
+    {"real modifier held while the immediate modifier is undone stays down",
+     BASE_CONFIG,
+     tap_with_real_modifier,
+     {{KEY_LEFTCTRL, 1}, {KEY_F, 1}, {KEY_F, 0}, {KEY_LEFTCTRL, 0}, END},
+     false},
+};
+
+static void write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+/* Write the config to a temporary file, named after the template path. */
+static void write_config(const char *config, char *path) {
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        exit(EXIT_FAILURE);
+    }
+    write_all(fd, config, strlen(config));
+    close(fd);
+}
+
+/* Run the plugin on the trace and collect the key events of its output, and
+ * its SYN_REPORT events if is_framed. Return the number of them, or -1 if the
+ * plugin failed. */
+static int run_plugin(const char *plugin, const char *config_path,
+                      bool is_framed, struct key_event *keys, int max_keys) {
+    int in_pipe[2], out_pipe[2];
+    if (pipe(in_pipe) == -1 || pipe(out_pipe) == -1) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        dup2(in_pipe[0], STDIN_FILENO);
+        dup2(out_pipe[1], STDOUT_FILENO);
+        close(in_pipe[0]);
+        close(in_pipe[1]);
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        execl(plugin, plugin, "--no-config-cache", "-c", config_path,
+              (char *)NULL);
+        perror(plugin);
+        _exit(127);
+    }
+    close(in_pipe[0]);
+    close(out_pipe[1]);
+
+    // The traces are short enough for the pipe buffers, so the whole trace
+    // can go in before reading anything.
+    write_all(in_pipe[1], trace, trace_size * sizeof(*trace));
+    close(in_pipe[1]);
+
+    int size = 0;
+    input_event event;
+    size_t fill = 0;
+    for (;;) {
+        ssize_t n = read(out_pipe[0], (char *)&event + fill,
+                         sizeof(event) - fill);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        fill += n;
+        if (fill < sizeof(event))
+            continue;
+        fill = 0;
+        if (size == max_keys)
+            continue;
+        if (event.type == EV_KEY)
+            keys[size++] = (struct key_event){event.code, event.value};
+        else if (is_framed && event.type == EV_SYN &&
+                 event.code == SYN_REPORT)
+            keys[size++] = (struct key_event)SYN;
+    }
+    close(out_pipe[0]);
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != EXIT_SUCCESS)
+        return -1;
+    return size;
+}
+
+static void print_keys(const char *label, const struct key_event *keys,
+                       int size) {
+    fprintf(stderr, "  %s:", label);
+    for (int i = 0; i < size; i++) {
+        if (keys[i].code == KEY_CNT)
+            fprintf(stderr, " SYN");
+        else
+            fprintf(stderr, " %d%s", keys[i].code, keys[i].value ? "+" : "-");
+    }
+    fprintf(stderr, "\n");
+}
+
+static bool run_test_case(const char *plugin, const struct test_case *test) {
+    struct key_event keys[MAX_EVENTS];
+
+    trace_size = 0;
+    trace_time = (struct timeval){.tv_sec = 1600000000};
+    test->build_trace();
+
+    char config_path[] = "/tmp/home-row-fu-test.XXXXXX";
+    write_config(test->config, config_path);
+    int size =
+        run_plugin(plugin, config_path, test->is_framed, keys, MAX_EVENTS);
+    unlink(config_path);
+
+    int expected_size = 0;
+    while (test->expected[expected_size].value != -1)
+        expected_size++;
+
+    bool ok = size == expected_size;
+    for (int i = 0; ok && i < size; i++)
+        ok = keys[i].code == test->expected[i].code &&
+             keys[i].value == test->expected[i].value;
+
+    printf("%s - %s\n", ok ? "ok" : "FAIL", test->name);
+    if (!ok) {
+        print_keys("expected", test->expected, expected_size);
+        if (size < 0)
+            fprintf(stderr, "  the plugin failed\n");
+        else
+            print_keys("got", keys, size);
+    }
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s PLUGIN\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(test_cases) / sizeof(*test_cases); i++) {
+        if (!run_test_case(argv[1], &test_cases[i]))
+            failed++;
+    }
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}